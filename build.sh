@@ -5,4 +5,51 @@ if [ ! -d "dist" ]; then
   mkdir dist
 fi
 
-gcc -o dist/m2ha src/m2ha.c -lportmidi -lcurl
\ No newline at end of file
+# with alsa-lib installed midi is read from the alsa sequencer, portmidi stays as the fallback (-M portmidi)
+if pkg-config --exists alsa 2>/dev/null; then
+  gcc -DM2HA_ALSA -o dist/m2ha src/m2ha.c -lportmidi -lcurl -lasound -lpthread
+else
+  gcc -o dist/m2ha src/m2ha.c -lportmidi -lcurl -lpthread
+fi
+gcc -o dist/ha_stub src/ha_stub.c
+gcc -o dist/m2ha_headless src/m2ha.c src/pm_stub.c -lcurl -lpthread
+gcc -O2 -DM2HA_BENCH -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc -o dist/m2ha_bench src/m2ha.c src/pm_stub.c -lcurl -lpthread
+
+# ./build.sh bench [m2ha options] runs the benchmark against ha_stub on the loopback, once per transport
+if [ "$1" = "bench" ]; then
+  shift
+  ./dist/ha_stub -p 8124 > /dev/null 2>&1 < /dev/null &
+  stub=$!
+  sleep 0.5
+  for transport in rest websocket; do
+    TOKEN=bench ./dist/m2ha_bench -N -t 0 -T $transport -u http://127.0.0.1:8124 "$@" bench 5 | grep "^bench:"
+  done
+  kill $stub
+fi
+
+# ./build.sh fairness runs the benchmark with the default throttle and fails when a call waits over a second to be sent, as the pots would if the sweeping faders could starve them
+if [ "$1" = "fairness" ]; then
+  ./dist/ha_stub -p 8124 > /dev/null 2>&1 < /dev/null &
+  stub=$!
+  sleep 0.5
+  stats=$(TOKEN=bench ./dist/m2ha_bench -N -t 100000 -u http://127.0.0.1:8124 bench 3 2>&1)
+  kill $stub
+  echo "$stats" | awk '/^dequeue -> send/ { max = $NF } END { if (max == "" || max > 1000000) { print "fairness: dequeue -> send max " max "us"; exit 1 } print "fairness: ok" }'
+fi
+
+# ./build.sh replay runs the recordings in test/replay against ha_stub: for session the calls and final states must be the expected ones,
+# for sweep (several seconds of faders and pots moving together) the final state of every entity, its calls depend on where the throttle windows fall
+replay() {
+  ./dist/ha_stub -p 8124 > dist/replay.log 2>&1 < /dev/null &
+  stub=$!
+  sleep 0.5
+  TOKEN=replay ./dist/m2ha_headless -N -x $2 -u http://127.0.0.1:8124 replay test/replay/$1.m2harec > /dev/null
+  kill -INT $stub
+  wait $stub
+}
+if [ "$1" = "replay" ]; then
+  replay session 0
+  sed 's/^[0-9]* //' dist/replay.log | grep -v "^ha_stub listening" | diff test/replay/session.expected - &&
+  replay sweep 4 &&
+  grep "^state" dist/replay.log | sort | diff test/replay/sweep.expected - && echo "replay: ok"
+fi
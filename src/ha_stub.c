@@ -0,0 +1,522 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <stdint.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+/*
+
+    local stand-in for home assistant, used to exercise m2ha without a server.
+    accepts service calls as REST POSTs to /api/services/<domain>/<service>
+    and over the websocket api on /api/websocket (any token is accepted)
+    and logs every call it receives to stdout, one line per call:
+
+        <millis> <rest|websocket> <domain>/<service> <service data>
+
+    the calls are applied to a small table of entity states, served by
+    GET /api/states and pushed to state trigger subscriptions. a line on
+    stdin like "light.kitchen on 50" (or "... off") changes an entity as
+    if it was done from somewhere else. on SIGINT or SIGTERM the final
+    state of every entity is printed, one line each:
+
+        state <entity_id> <on|off> <brightness 0-255> <kelvin>
+
+    gcc -o dist/ha_stub src/ha_stub.c
+    ./dist/ha_stub -p 8123
+    TOKEN=x ./dist/m2ha -u http://127.0.0.1:8123 -T websocket run
+
+*/
+
+#define MAX_CLIENTS 16
+#define MAX_ENTITIES 64
+#define BUFFER_SIZE 65536
+
+struct client {
+    int fd;
+    int websocket;
+    long subscription;                  /* id of its subscribe_trigger, 0 for none */
+    size_t length;
+    char buffer[BUFFER_SIZE];
+};
+
+struct entity {
+    char entity_id[64];
+    int on;
+    int brightness;                     /* 0-255 */
+    int kelvin;
+};
+
+struct client clients[MAX_CLIENTS];
+struct entity entities[MAX_ENTITIES];
+int entity_count = 0;
+int delay = 0;
+volatile sig_atomic_t done = 0;
+
+void interrupt_handler(int signal) {
+    (void)signal;
+    done = 1;
+}
+
+long long millis(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/*
+sha1 + base64, only needed for the handshake accept key
+*/
+
+void sha1(const unsigned char *data, size_t length, unsigned char out[20]) {
+    uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+    size_t padded = ((length + 8) / 64 + 1) * 64;
+    unsigned char *message = calloc(padded, 1);
+    memcpy(message, data, length);
+    message[length] = 0x80;
+    uint64_t bits = (uint64_t)length * 8;
+    int i;
+    for (i = 0; i < 8; i++) message[padded - 1 - i] = bits >> (8 * i);
+
+    size_t chunk;
+    for (chunk = 0; chunk < padded; chunk += 64) {
+        uint32_t w[80];
+        for (i = 0; i < 16; i++) {
+            w[i] = message[chunk + i * 4] << 24 | message[chunk + i * 4 + 1] << 16 | message[chunk + i * 4 + 2] << 8 | message[chunk + i * 4 + 3];
+        }
+        for (i = 16; i < 80; i++) {
+            uint32_t x = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16];
+            w[i] = x << 1 | x >> 31;
+        }
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (i = 0; i < 80; i++) {
+            uint32_t f, k;
+            if (i < 20)      { f = (b & c) | (~b & d);          k = 0x5A827999; }
+            else if (i < 40) { f = b ^ c ^ d;                    k = 0x6ED9EBA1; }
+            else if (i < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC; }
+            else             { f = b ^ c ^ d;                    k = 0xCA62C1D6; }
+            uint32_t temp = (a << 5 | a >> 27) + f + e + k + w[i];
+            e = d; d = c; c = b << 30 | b >> 2; b = a; a = temp;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+    }
+    free(message);
+
+    for (i = 0; i < 20; i++) out[i] = h[i / 4] >> (24 - 8 * (i % 4));
+}
+
+void base64(const unsigned char *in, int length, char *out) {
+    static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    int i;
+    for (i = 0; i < length; i += 3) {
+        int value = in[i] << 16 | (i + 1 < length ? in[i + 1] << 8 : 0) | (i + 2 < length ? in[i + 2] : 0);
+        *out++ = table[(value >> 18) & 0x3f];
+        *out++ = table[(value >> 12) & 0x3f];
+        *out++ = i + 1 < length ? table[(value >> 6) & 0x3f] : '=';
+        *out++ = i + 2 < length ? table[value & 0x3f] : '=';
+    }
+    *out = '\0';
+}
+
+void send_text(struct client *c, char *text) {
+    size_t length = strlen(text);
+    unsigned char frame[BUFFER_SIZE];
+    int header_length = 2;
+    if (length + 4 > BUFFER_SIZE) return;
+    frame[0] = 0x81;
+    if (length < 126) {
+        frame[1] = length;
+    } else {
+        frame[1] = 126;
+        frame[2] = length >> 8;
+        frame[3] = length & 0xff;
+        header_length = 4;
+    }
+    memcpy(frame + header_length, text, length);
+    send(c->fd, frame, header_length + length, MSG_NOSIGNAL);
+}
+
+char *find_string(char *json, char *key, char *out, size_t size) {
+    char quoted[40];
+    snprintf(quoted, sizeof(quoted), "\"%s\"", key);
+    char *found = strstr(json, quoted);
+    out[0] = '\0';
+    if (found == NULL) return out;
+    found = strchr(found + strlen(quoted), '"');
+    if (found == NULL) return out;
+    size_t length = strcspn(found + 1, "\"");
+    if (length >= size) length = size - 1;
+    memcpy(out, found + 1, length);
+    out[length] = '\0';
+    return out;
+}
+
+/*
+entity states
+*/
+
+struct entity *find_entity(char *entity_id) {
+    int i;
+    for (i = 0; i < entity_count; i++) {
+        if (strcmp(entities[i].entity_id, entity_id) == 0) return &entities[i];
+    }
+    if (entity_count == MAX_ENTITIES) return NULL;
+    struct entity *e = &entities[entity_count++];
+    snprintf(e->entity_id, sizeof(e->entity_id), "%s", entity_id);
+    e->on = 0;
+    e->brightness = 255;
+    e->kelvin = 2700;
+    return e;
+}
+
+int format_state(struct entity *e, char *out, size_t size) {
+    if (!e->on) {
+        return snprintf(out, size, "{\"entity_id\": \"%s\", \"state\": \"off\", \"attributes\": {\"brightness\": null, \"color_temp_kelvin\": null}, \"last_changed\": \"stub\"}", e->entity_id);
+    }
+    return snprintf(out, size, "{\"entity_id\": \"%s\", \"state\": \"on\", \"attributes\": {\"brightness\": %d, \"color_temp_kelvin\": %d}, \"last_changed\": \"stub\"}",
+        e->entity_id, e->brightness, e->kelvin);
+}
+
+void send_text(struct client *c, char *text);
+
+void notify(struct entity *e) {
+    char state[300];
+    char event[500];
+    format_state(e, state, sizeof(state));
+    int i;
+    for (i = 0; i < MAX_CLIENTS; i++) {
+        if (clients[i].fd == -1 || clients[i].subscription == 0) continue;
+        snprintf(event, sizeof(event), "{\"id\": %ld, \"type\": \"event\", \"event\": {\"variables\": {\"trigger\": {\"platform\": \"state\", \"entity_id\": \"%s\", \"to_state\": %s}}}}",
+            clients[i].subscription, e->entity_id, state);
+        send_text(&clients[i], event);
+    }
+}
+
+void apply_call(char *service, char *data) {
+    char *ids = strstr(data, "\"entity_id\"");
+    if (ids == NULL) return;
+    ids += 12;
+    while (*ids == ' ' || *ids == ':') ids++;
+    char *end = *ids == '[' ? strchr(ids, ']') : strchr(ids + 1, '"');
+    if (end == NULL) return;
+
+    char *pct = strstr(data, "\"brightness_pct\"");
+    char *kelvin = strstr(data, "\"kelvin\"");
+
+    while (ids < end) {
+        char *start = strchr(ids, '"');
+        if (start == NULL || start >= end) break;
+        char *stop = strchr(start + 1, '"');
+        if (stop == NULL) break;
+        *stop = '\0';
+        struct entity *e = find_entity(start + 1);
+        *stop = '"';
+        ids = stop + 1;
+        if (e == NULL) continue;
+
+        if (strcmp(service, "turn_off") == 0) {
+            e->on = 0;
+        } else if (strcmp(service, "toggle") == 0) {
+            e->on = !e->on;
+        } else if (strcmp(service, "turn_on") == 0) {
+            e->on = 1;
+            if (pct) e->brightness = (atoi(strchr(pct + 16, ':') + 1) * 255 + 50) / 100;
+            if (pct && e->brightness == 0) e->on = 0;
+            if (kelvin) e->kelvin = atoi(strchr(kelvin + 8, ':') + 1);
+        }
+        notify(e);
+    }
+}
+
+void handle_input(char *line) {
+    char entity_id[64], state[8];
+    int brightness_pct = 100;
+    if (sscanf(line, "%63s %7s %d", entity_id, state, &brightness_pct) < 2) return;
+    struct entity *e = find_entity(entity_id);
+    if (e == NULL) return;
+    e->on = strcmp(state, "on") == 0;
+    e->brightness = (brightness_pct * 255 + 50) / 100;
+    notify(e);
+}
+
+/*
+websocket
+*/
+
+void handle_message(struct client *c, char *message) {
+    char type[40];
+    find_string(message, "type", type, sizeof(type));
+
+    if (strcmp(type, "auth") == 0) {
+        send_text(c, "{\"type\":\"auth_ok\",\"ha_version\":\"stub\"}");
+        return;
+    }
+
+    long request_id = 0;
+    char *id = strstr(message, "\"id\"");
+    if (id) {
+        id += 4;
+        while (*id == ' ' || *id == ':') id++;
+        request_id = strtol(id, NULL, 10);
+    }
+
+    if (strcmp(type, "call_service") == 0) {
+        char domain[40], service[40];
+        find_string(message, "domain", domain, sizeof(domain));
+        find_string(message, "service", service, sizeof(service));
+        char *data = strstr(message, "\"service_data\"");
+        data = data ? strchr(data, '{') : "{}";
+        size_t data_length = strlen(data);
+        if (data_length > 0 && data[data_length - 1] == '}') data_length--;
+        printf("%lld websocket %s/%s %.*s\n", millis(), domain, service, (int)data_length, data);
+        fflush(stdout);
+        apply_call(service, data);
+    } else if (strcmp(type, "subscribe_trigger") == 0) {
+        c->subscription = request_id;
+    }
+
+    if (delay) usleep(delay * 1000);
+
+    char reply[200];
+    snprintf(reply, sizeof(reply), "{\"id\":%ld,\"type\":\"result\",\"success\":true,\"result\":null}", request_id);
+    send_text(c, reply);
+}
+
+void read_frames(struct client *c) {
+    while (c->length >= 6) {
+        unsigned char *frame = (unsigned char *)c->buffer;
+        int opcode = frame[0] & 0x0f;
+        size_t length = frame[1] & 0x7f;
+        size_t header = 2;
+        if (length == 126) {
+            length = frame[2] << 8 | frame[3];
+            header = 4;
+        }
+        unsigned char *mask = frame + header;
+        header += 4;
+        if (c->length < header + length) return;
+
+        char *payload = c->buffer + header;
+        size_t i;
+        for (i = 0; i < length; i++) payload[i] ^= mask[i & 3];
+
+        if (opcode == 0x1) {
+            char saved = payload[length];
+            payload[length] = '\0';
+            handle_message(c, payload);
+            payload[length] = saved;
+        } else if (opcode == 0x8) {
+            close(c->fd);
+            c->fd = -1;
+            return;
+        }
+
+        memmove(c->buffer, c->buffer + header + length, c->length - header - length);
+        c->length -= header + length;
+    }
+}
+
+/*
+http
+*/
+
+void send_response(struct client *c, char *status, char *body, size_t length) {
+    char header[200];
+    int header_length = snprintf(header, sizeof(header),
+        "HTTP/1.1 %s\r\nContent-Type: application/json\r\nContent-Length: %zu\r\n\r\n", status, length);
+    send(c->fd, header, header_length, MSG_NOSIGNAL);
+    if (length) send(c->fd, body, length, MSG_NOSIGNAL);
+}
+
+int handle_request(struct client *c) {
+
+    /* answer one complete request at the start of the buffer, returns 0 when more bytes are needed */
+
+    char *end = strstr(c->buffer, "\r\n\r\n");
+    if (end == NULL) return 0;
+    char *body = end + 4;
+
+    size_t content_length = 0;
+    char *header = strstr(c->buffer, "Content-Length:");
+    if (header == NULL) header = strstr(c->buffer, "content-length:");
+    if (header && header < end) content_length = strtoul(header + 15, NULL, 10);
+    if (c->length < (size_t)(body - c->buffer) + content_length) return 0;
+
+    if (strncmp(c->buffer, "GET /api/websocket", 18) == 0) {
+        char key[100];
+        char *header = strstr(c->buffer, "Sec-WebSocket-Key:");
+        if (header == NULL) header = strstr(c->buffer, "sec-websocket-key:");
+        key[0] = '\0';
+        if (header) sscanf(header + 18, " %60s", key);
+        strcat(key, "258EAFA5-E914-47DA-95CA-C5AB0DC85B11");
+
+        unsigned char digest[20];
+        char accept[40];
+        sha1((unsigned char *)key, strlen(key), digest);
+        base64(digest, 20, accept);
+
+        char response[300];
+        snprintf(response, sizeof(response),
+            "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n\r\n", accept);
+        send(c->fd, response, strlen(response), MSG_NOSIGNAL);
+
+        c->websocket = 1;
+        c->length -= body - c->buffer;
+        memmove(c->buffer, body, c->length + 1);
+        send_text(c, "{\"type\":\"auth_required\",\"ha_version\":\"stub\"}");
+        return 0;
+    }
+
+    if (strncmp(c->buffer, "POST /api/services/", 19) == 0) {
+        char domain[40], service[40];
+        if (sscanf(c->buffer + 19, "%39[^/]/%39[^ ]", domain, service) == 2) {
+            char saved = body[content_length];
+            body[content_length] = '\0';
+            printf("%lld rest %s/%s %s\n", millis(), domain, service, body);
+            fflush(stdout);
+            apply_call(service, body);
+            body[content_length] = saved;
+            if (delay) usleep(delay * 1000);
+            send_response(c, "200 OK", "[]", 2);
+        } else {
+            send_response(c, "400 Bad Request", "", 0);
+        }
+    } else if (strncmp(c->buffer, "GET /api/states ", 16) == 0) {
+        char states[BUFFER_SIZE];
+        size_t length = 1;
+        int i;
+        states[0] = '[';
+        for (i = 0; i < entity_count && length < BUFFER_SIZE - 400; i++) {
+            if (i) states[length++] = ',';
+            length += format_state(&entities[i], states + length, BUFFER_SIZE - length);
+        }
+        states[length++] = ']';
+        send_response(c, "200 OK", states, length);
+    } else {
+        send_response(c, "404 Not Found", "", 0);
+    }
+
+    /* keep whatever the client already sent after this request */
+    size_t used = body - c->buffer + content_length;
+    c->length -= used;
+    memmove(c->buffer, c->buffer + used, c->length + 1);
+    return 1;
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    int port = 8123;
+
+    while ((opt = getopt(argc, argv, "p:d:")) != -1) {
+        switch (opt) {
+            case 'p':
+                port = atoi(optarg);
+                break;
+            case 'd':
+                delay = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-p port] [-d reply_delay_ms]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    signal(SIGINT, interrupt_handler);
+    signal(SIGTERM, interrupt_handler);
+
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(listener, 16) != 0) {
+        perror("listen");
+        return 1;
+    }
+    fprintf(stderr, "ha_stub listening on 127.0.0.1:%d\n", port);
+
+    int i;
+    for (i = 0; i < MAX_CLIENTS; i++) clients[i].fd = -1;
+
+    int input = 0;
+
+    while (!done) {
+        struct pollfd fds[MAX_CLIENTS + 2];
+        fds[0].fd = listener;
+        fds[0].events = POLLIN;
+        for (i = 0; i < MAX_CLIENTS; i++) {
+            fds[i + 1].fd = clients[i].fd;
+            fds[i + 1].events = POLLIN;
+        }
+        fds[MAX_CLIENTS + 1].fd = input;
+        fds[MAX_CLIENTS + 1].events = POLLIN;
+
+        if (poll(fds, MAX_CLIENTS + 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            return 1;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            int fd = accept(listener, NULL, NULL);
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            for (i = 0; i < MAX_CLIENTS && clients[i].fd != -1; i++);
+            if (i == MAX_CLIENTS) {
+                close(fd);
+            } else {
+                clients[i].fd = fd;
+                clients[i].websocket = 0;
+                clients[i].subscription = 0;
+                clients[i].length = 0;
+            }
+        }
+
+        if (fds[MAX_CLIENTS + 1].revents & (POLLIN | POLLHUP)) {
+            char line[200];
+            ssize_t received = read(input, line, sizeof(line) - 1);
+            if (received <= 0) {
+                input = -1;
+            } else {
+                line[received] = '\0';
+                handle_input(line);
+            }
+        }
+
+        for (i = 0; i < MAX_CLIENTS; i++) {
+            struct client *c = &clients[i];
+            if (c->fd == -1 || !(fds[i + 1].revents & (POLLIN | POLLHUP))) continue;
+
+            ssize_t received = recv(c->fd, c->buffer + c->length, BUFFER_SIZE - 1 - c->length, 0);
+            if (received <= 0) {
+                close(c->fd);
+                c->fd = -1;
+                continue;
+            }
+            c->length += received;
+            c->buffer[c->length] = '\0';
+
+            while (!c->websocket && handle_request(c));
+            if (c->fd != -1 && c->websocket) read_frames(c);
+        }
+    }
+
+    /* final state, for checking the outcome of a replay */
+    for (i = 0; i < entity_count; i++) {
+        printf("state %s %s %d %d\n", entities[i].entity_id, entities[i].on ? "on" : "off", entities[i].brightness, entities[i].kelvin);
+    }
+    fflush(stdout);
+
+    return 0;
+}
@@ -1,635 +1,4663 @@
-/* mm.c -- midi monitor */
-
-#include "stdlib.h"
-#include "ctype.h"
-#include "string.h"
-#include "stdio.h"
-#include "porttime.h"
-#include "portmidi.h"
-#include "signal.h"
-#include <unistd.h>
-#include <curl/curl.h>
-#include <sys/time.h>
-
-
-#define MIDI_CODE_MASK  0xf0
-#define MIDI_CHN_MASK   0x0f
-
-#define private static
-
-#ifndef false
-#define false 0
-#define true 1
-#endif
-
-typedef int boolean;
-extern  int     abort_flag;
-
-struct kontrol2_control {
-    char *name;
-    int channel;
-};
-
-/*
-global variables
-*/
-
-PmStream *midi_in;
-int debug = false;	                    /* never set, but referenced by userio.c */
-boolean active = false;                 /* set when midi_in is ready for reading */
-boolean shift = false;                  /* set when shift button is pressed */
-volatile sig_atomic_t done = 0;         /* when non zero, exit */;
-
-struct timeval current_timeval;
-long long last_api_call = 0;
-
-int throttle = 100000;
-char *device_name = "nanoKONTROL2 nanoKONTROL2 _ CTR";
-
-char queued_api_endpoint[100] = "";
-char queued_api_body[100] = "";
-
-/*
-local functions
-*/
-
-private void handle_midi_event(PmMessage data);
-char *channel_to_entity_id(int channel, boolean shift);
-struct kontrol2_control get_nano_kontrol2_control(int control);
-int api_call(char *endpoint, char *body);
-
-
-void poll_midi_device(PtTimestamp timestamp, void *userData) {
-    PmEvent event;
-    int count;
-    if (!active) return;
-    while ((count = Pm_Read(midi_in, &event, 1))) {
-        if (count == 1) handle_midi_event(event.message);
-        else            puts(Pm_GetErrorText(count));
-    }
-}
-
-
-void interrupt_handler(int dummy) {
-    done = 1;
-    printf("Caught signal %d\n", dummy);
-}
-
-
-void help_menu(int exit_code) {
-    puts("Usage: mm -dt [run|list] ");
-    puts("Commands:");
-    puts("  run                     Start the MIDI monitor.");
-    puts("  list                    List available MIDI devices.");
-    puts("  help                    Show this help message.");
-    puts("Options:");
-    printf("  -d <device_name>        Specify the MIDI device name to use. Default: '%s'\n", device_name);
-    printf("  -t <throttle>           Set the throttle for API calls in microseconds. Default: %d\n", throttle);
-    exit(exit_code);
-}
-
-/*
-main
-*/
-
-int main(int argc, char **argv) {
-
-    /*
-    parse cli arguments
-    */
-
-    int opt;
-    char *command;
-
-    while ((opt = getopt(argc, argv, "d:t:")) != -1) {
-        switch (opt) {
-            case 'd':
-                device_name = optarg;
-                break;
-            case 't':
-                throttle = atoi(optarg);
-                break;
-            case '?':
-                help_menu(1);
-                return 1;
-        }
-    }
-
-    if (optind < argc) {
-        command = argv[optind];
-    }else {
-        printf("No command provided.\n");
-        help_menu(1);
-    }
-
-    if (strcmp(command, "help") == 0 || strcmp(command, "--help") == 0 || strcmp(command, "-h") == 0) {
-        help_menu(0);
-    }
-
-    /* 
-    select / list input device 
-    */
-
-    int device_index = -1;
-    
-    Pt_Start(1, poll_midi_device, 0);
-    if (strcmp(command, "list") == 0) puts("MIDI input devices:");
-
-    int i;
-    for (i = 0; i < Pm_CountDevices(); i++) {
-        const PmDeviceInfo *info = Pm_GetDeviceInfo(i);
-
-        if (strcmp(command, "list") == 0 && info->input) printf("  %d) '%s'\n", i, info->name);
-
-        if (strcmp(info->name, device_name) == 0) {
-            device_index = i;
-        }
-    }
-
-    if (strcmp(command, "list") == 0) {
-        Pt_Stop();
-        exit(0);
-    }
-    
-    if (device_index == -1) {
-        printf("Could not find device '%s'.\n", device_name);
-        exit(1);
-    }
-
-    /* 
-    init midi 
-    */
-
-    PmError err;
-    err = Pm_OpenInput(&midi_in, device_index, NULL, 512, NULL, NULL);
-    if (err) {
-        puts(Pm_GetErrorText(err));
-        Pt_Stop();
-        exit(1);
-    }
-
-    printf("Midi device opened: %s\n", device_name);
-    printf("Midi Monitor ready. (pid: %d) (Control+C to exit)\n", getpid());
-    active = true;
-
-    /* 
-    main loop 
-    */
-
-    signal(SIGINT, interrupt_handler);
-    signal(SIGTERM, interrupt_handler);
-
-    while (!done) {
-
-        /*
-        
-        this is the main loop of the program,
-        it checks for queued messages and sends them to the api
-        if the throttle time has passed since the last api call.
-        this throttle prevents the server from being overloaded with requests,
-        but ensures the last value input from the user is sent to the api.
-        
-        */
-
-        gettimeofday(&current_timeval, NULL);
-        long long time_in_micros = (long long)current_timeval.tv_sec * 1000000 + current_timeval.tv_usec;
-
-        if (time_in_micros - last_api_call > throttle) {
-            if (strlen(queued_api_endpoint) > 0) {
-                char *endpoint = malloc(strlen(queued_api_endpoint) + 1);
-                char *body = malloc(strlen(queued_api_body) + 1);
-
-                strcpy(endpoint, queued_api_endpoint);
-                strcpy(body, queued_api_body);
-                
-                strcpy(queued_api_endpoint, "");
-                strcpy(queued_api_body, "");
-
-                api_call(endpoint, body);
-                free(endpoint);
-                free(body);
-            }
-        }
-
-    }
-
-    /* 
-    clean up and exit 
-    */
-
-    printf("Midi Monitor exiting.\n");
-    active = false;
-    Pm_Close(midi_in);
-    Pt_Stop();
-    Pm_Terminate();
-
-    return 0;
-
-}
-
-
-private void handle_midi_event(PmMessage data) {
-
-    /*
-    this function handles incoming midi events,
-    it maps the message to an api call and queues it
-    by copying the endpoint and body to a global variable
-    */
-
-    int midi_command;
-    int midi_channel;
-    int midi_control;
-    int midi_value;
-
-    midi_command = Pm_MessageStatus(data) & MIDI_CODE_MASK;
-    midi_channel = Pm_MessageStatus(data) & MIDI_CHN_MASK;
-    midi_control = Pm_MessageData1(data);
-    midi_value = Pm_MessageData2(data);
-
-    struct kontrol2_control control = get_nano_kontrol2_control(midi_control);
-
-    float percent = (float)midi_value / 127.0f;
-
-    if (strcmp(control.name, "fader") == 0) {
-        int int_percent = (int)(percent * 100);
-        char *entity_id = channel_to_entity_id(control.channel, shift);
-
-        strcpy(queued_api_endpoint, "light/turn_on");
-        sprintf(queued_api_body, "{\"entity_id\": \"%s\", \"brightness_pct\": %d}", entity_id, int_percent);
-
-    } else if (strcmp(control.name, "pot") == 0) {
-        int kelvin = (int)(2000 + (percent * (6493 - 2000)));
-        char *entity_id = channel_to_entity_id(control.channel, shift);
-        
-        strcpy(queued_api_endpoint, "light/turn_on");
-        sprintf(queued_api_body, "{\"entity_id\": \"%s\", \"kelvin\": %d}", entity_id, kelvin);
-
-    } else if (strcmp(control.name, "play") == 0) {
-        if(midi_value == 127) {
-            // printf("%s (%2d) - press\n", control.name, control.channel);
-        }else{
-            strcpy(queued_api_endpoint, "switch/toggle");
-            strcpy(queued_api_body, "{\"entity_id\": \"switch.0x282c02bfffee12e7\"}");
-        }
-    } else if (strcmp(control.name, "mute") == 0) {
-        if(midi_value == 127) {
-            // printf("%s (%2d) - press\n", control.name, control.channel);
-        }else{
-            char *entity_id = channel_to_entity_id(control.channel, shift);
-            strcpy(queued_api_endpoint, "light/turn_off");
-            sprintf(queued_api_body, "{\"entity_id\": \"%s\"}", entity_id);
-        }
-    } else if (strcmp(control.name, "cycle") == 0) {
-        if(midi_value == 127) {
-            shift = true;
-        }else{
-            shift = false;
-        }
-    } else {
-        if(midi_value == 127) {
-            // printf("%s (%2d) - press\n", control.name, control.channel);
-        }else{
-            // printf("%s (%2d) - release\n", control.name, control.channel);
-        }
-    }
-
-    fflush(stdout);
-}
-
-char *channel_to_entity_id(int channel, boolean shift) {
-
-    if (shift) {
-        switch (channel) {
-            case 1: return "light.0xb0ce18140015fb0c";
-            case 2: return "light.0xb0ce1814001b1ee1";
-            default: return "";
-        }
-    }else {
-        switch (channel) {
-            case 1: return "light.0xb0ce1814001610b3";
-            case 2: return "light.0xb0ce181400163588";
-            case 3: return "light.0xb0ce1814001b08fb";
-            case 4: return "light.0xb0ce18140017bf5e";
-            case 5: return "light.0xb0ce1814001af553";
-            case 6: return "light.0xb0ce1814001af427";
-            case 7: return "light.0xb0ce1814001af6f2";
-            case 8: return "light.0xb0ce181400160048";
-            default: return "";
-        }
-    }
-    
-}
-
-
-struct kontrol2_control get_nano_kontrol2_control(int control) {
-    struct kontrol2_control c;
-    switch (control) {
-
-        /* 
-        faders
-        */
-
-        case 0: 
-            c.name = "fader";
-            c.channel = 1;
-            break;
-        case 1:
-            c.name = "fader";
-            c.channel = 2;
-            break;
-        case 2:
-            c.name = "fader";
-            c.channel = 3;
-            break;
-        case 3:
-            c.name = "fader";
-            c.channel = 4;
-            break;
-        case 4:
-            c.name = "fader";
-            c.channel = 5;
-            break;
-        case 5:
-            c.name = "fader";
-            c.channel = 6;
-            break;
-        case 6:
-            c.name = "fader";
-            c.channel = 7;
-            break;
-        case 7:
-            c.name = "fader";
-            c.channel = 8;
-            break;
-
-        /*
-        pots
-        */
-
-        case 16:
-            c.name = "pot";
-            c.channel = 1;
-            break;
-        case 17:
-            c.name = "pot";
-            c.channel = 2;
-            break;
-        case 18:
-            c.name = "pot";
-            c.channel = 3;
-            break;
-        case 19:
-            c.name = "pot";
-            c.channel = 4;
-            break;
-        case 20:
-            c.name = "pot";
-            c.channel = 5;
-            break;
-        case 21:
-            c.name = "pot";
-            c.channel = 6;
-            break;
-        case 22:
-            c.name = "pot";
-            c.channel = 7;
-            break;
-        case 23:
-            c.name = "pot";
-            c.channel = 8;
-            break;
-
-        /*
-        solo buttons
-        */
-
-        case 32:
-            c.name = "solo";
-            c.channel = 1;
-            break;
-        case 33:
-            c.name = "solo";
-            c.channel = 2;
-            break;
-        case 34:
-            c.name = "solo";
-            c.channel = 3;
-            break;
-        case 35:
-            c.name = "solo";
-            c.channel = 4;
-            break;
-        case 36:
-            c.name = "solo";
-            c.channel = 5;
-            break;
-        case 37:
-            c.name = "solo";
-            c.channel = 6;
-            break;
-        case 38:
-            c.name = "solo";
-            c.channel = 7;
-            break;
-        case 39:
-            c.name = "solo";
-            c.channel = 8;
-            break;
-
-        /*
-        play controls
-        */
-        
-        case 41:
-            c.name = "play";
-            c.channel = -1;
-            break;
-        case 42:
-            c.name = "stop";
-            c.channel = -1;
-            break;
-        case 43:
-            c.name = "rewind";
-            c.channel = -1;
-            break;
-        case 44:
-            c.name = "fast-forward";
-            c.channel = -1;
-            break;
-        case 45:
-            c.name = "record";
-            c.channel = -1;
-            break;
-
-        case 46:
-            c.name = "cycle";
-            c.channel = -1;
-            break;
-
-        /*
-        mute buttons
-        */
-
-        case 48:
-            c.name = "mute";
-            c.channel = 1;
-            break;
-        case 49:
-            c.name = "mute";
-            c.channel = 2;
-            break;
-        case 50:
-            c.name = "mute";
-            c.channel = 3;
-            break;
-        case 51:
-            c.name = "mute";
-            c.channel = 4;
-            break;
-        case 52:
-            c.name = "mute";
-            c.channel = 5;
-            break;
-        case 53:
-            c.name = "mute";
-            c.channel = 6;
-            break;
-        case 54:
-            c.name = "mute";
-            c.channel = 7;
-            break;
-        case 55:
-            c.name = "mute";
-            c.channel = 8;
-            break;
-
-        /*
-        track and markers
-        */
-
-        case 58:
-            c.name = "track-left";
-            c.channel = -1;
-            break;
-        case 59:
-            c.name = "track-right";
-            c.channel = -1;
-            break;
-
-        case 60:
-            c.name = "marker-set";
-            c.channel = -1;
-            break;
-        case 61:
-            c.name = "marker-left";
-            c.channel = -1;
-            break;
-        case 62:
-            c.name = "marker-right";
-            c.channel = -1;
-            break;
-
-        /*
-        record buttons
-        */
-
-        case 64:
-            c.name = "record";
-            c.channel = 1;
-            break;
-        case 65:
-            c.name = "record";
-            c.channel = 2;
-            break;
-        case 66:
-            c.name = "record";
-            c.channel = 3;
-            break;
-        case 67:
-            c.name = "record";
-            c.channel = 4;
-            break;
-        case 68:
-            c.name = "record";
-            c.channel = 5;
-            break;
-        case 69:
-            c.name = "record";
-            c.channel = 6;
-            break;
-        case 70:
-            c.name = "record";
-            c.channel = 7;
-            break;
-        case 71:
-            c.name = "record";
-            c.channel = 8;
-            break;
-
-        default: 
-            c.name = "unknown";
-            c.channel = -1;
-            break;
-    }
-
-    return c;
-}
-
-
-size_t write_null(void *buffer, size_t size, size_t nmemb, void *userp) {
-    return size * nmemb;
-}
-
-
-int api_call(char *endpoint, char *body) {
-
-    CURL *curl;
-    CURLcode response;
-    curl = curl_easy_init();
-    if(curl) {
-
-        /* disable printing */
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_null);
-
-        /* headers */
-        struct curl_slist *headers = NULL;
-        char *token = getenv("TOKEN");
-        if (token == NULL) {
-            fprintf(stderr, "TOKEN environment variable not set\n");
-            return 1;
-        }
-        char *auth_header = malloc(strlen("Authorization: Bearer ") + strlen(token) + 1);
-        sprintf(auth_header, "Authorization: Bearer %s", token);
-        headers = curl_slist_append(headers, auth_header);
-        free(auth_header);
-        headers = curl_slist_append(headers, "Content-Type: application/json");
-
-        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-
-        /* post body */
-        curl_easy_setopt(curl, CURLOPT_POST, 1L);
-        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body);
-
-        /* url */
-        char url[100];
-        sprintf(url, "http://homeassistant.local:8123/api/services/%s", endpoint);
-        curl_easy_setopt(curl, CURLOPT_URL, url);
-
-        /* Perform the request, res will get the return code */
-        response = curl_easy_perform(curl);
-
-        // printf("result code: %d\n", response);
-
-        /* check for errors */
-        if(response != CURLE_OK) {
-            fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(response));
-            return 1;
-        }
-
-        /* always cleanup */
-        curl_easy_cleanup(curl);
-        return 0;
-    }
-    fprintf(stderr, "Failed to initialize curl\n");
-    return 1;
-}
\ No newline at end of file
+/* mm.c -- midi monitor */
+
+#define _GNU_SOURCE
+
+#include "stdlib.h"
+#include "ctype.h"
+#include "string.h"
+#include "stdio.h"
+#include "porttime.h"
+#include "portmidi.h"
+#include "signal.h"
+#include <unistd.h>
+#include <curl/curl.h>
+#include <time.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#ifdef M2HA_ALSA
+#include <alsa/asoundlib.h>
+#endif
+
+
+#define MIDI_CODE_MASK  0xf0
+#define MIDI_CHN_MASK   0x0f
+
+#define MIDI_NOTE_OFF       0x80
+#define MIDI_NOTE_ON        0x90
+#define MIDI_CONTROL_CHANGE 0xb0
+
+#define CACHE_LINE_SIZE 64
+
+#define private static
+
+#ifndef false
+#define false 0
+#define true 1
+#endif
+
+typedef int boolean;
+extern  int     abort_flag;
+
+/*
+controller profiles describe which cc each control of a controller sends.
+a profile is an X-macro list of X(type, first cc, strips): strips
+consecutive ccs starting at first cc are that control on strip 1, 2, ..
+(transport buttons are a single control on no strip). the lists are
+expanded at compile time with range designators into a 128 byte table
+indexed by cc, so finding a control is one load instead of a switch and
+string compares. a new controller is a new list and a line in profiles
+*/
+
+enum control_type {
+    CONTROL_NONE, CONTROL_FADER, CONTROL_POT, CONTROL_SOLO, CONTROL_MUTE, CONTROL_RECORD,
+    CONTROL_PLAY, CONTROL_STOP, CONTROL_REWIND, CONTROL_FAST_FORWARD, CONTROL_RECORD_ALL, CONTROL_CYCLE,
+    CONTROL_TRACK_LEFT, CONTROL_TRACK_RIGHT, CONTROL_MARKER_SET, CONTROL_MARKER_LEFT, CONTROL_MARKER_RIGHT,
+    CONTROL_TYPE_COUNT
+};
+
+#define NANO_KONTROL2_CONTROLS(X) \
+    X(CONTROL_FADER, 0, 8) \
+    X(CONTROL_POT, 16, 8) \
+    X(CONTROL_SOLO, 32, 8) \
+    X(CONTROL_PLAY, 41, 1) \
+    X(CONTROL_STOP, 42, 1) \
+    X(CONTROL_REWIND, 43, 1) \
+    X(CONTROL_FAST_FORWARD, 44, 1) \
+    X(CONTROL_RECORD_ALL, 45, 1) \
+    X(CONTROL_CYCLE, 46, 1) \
+    X(CONTROL_MUTE, 48, 8) \
+    X(CONTROL_TRACK_LEFT, 58, 1) \
+    X(CONTROL_TRACK_RIGHT, 59, 1) \
+    X(CONTROL_MARKER_SET, 60, 1) \
+    X(CONTROL_MARKER_LEFT, 61, 1) \
+    X(CONTROL_MARKER_RIGHT, 62, 1) \
+    X(CONTROL_RECORD, 64, 8)
+
+/* factory template 1, its buttons send notes and are left to mapping files */
+#define LAUNCH_CONTROL_XL_CONTROLS(X) \
+    X(CONTROL_POT, 49, 8) \
+    X(CONTROL_FADER, 77, 8)
+
+struct controller_profile {
+    char *name;                         /* matched against the start of the device name */
+    uint8_t controls[128];              /* enum control_type of each cc */
+    uint8_t first[CONTROL_TYPE_COUNT];  /* cc of strip 1 of each type */
+};
+
+#define PROFILE_CONTROLS(type, cc, strips) [cc ... cc + strips - 1] = type,
+#define PROFILE_FIRST(type, cc, strips) [type] = cc,
+
+const struct controller_profile profiles[] = {
+    { "nanoKONTROL2", { NANO_KONTROL2_CONTROLS(PROFILE_CONTROLS) }, { NANO_KONTROL2_CONTROLS(PROFILE_FIRST) } },
+    { "Launch Control XL", { LAUNCH_CONTROL_XL_CONTROLS(PROFILE_CONTROLS) }, { LAUNCH_CONTROL_XL_CONTROLS(PROFILE_FIRST) } },
+};
+
+/*
+every update carries the time it passed each stage of the pipeline,
+from the midi thread through the queue to the http reply
+*/
+
+struct timing {
+    PmTimestamp timestamp;              /* portmidi time of the midi event */
+    long long arrived;                  /* CLOCK_MONOTONIC micros at each stage */
+    long long enqueued;
+    long long dequeued;
+    long long sent;
+};
+
+/*
+mappings turn (device, message kind, midi channel, control, shift layer)
+into an action. they are loaded from a file at startup, or built from the
+nanoKONTROL2 layout when no file is given, and compiled into a flat
+lookup table so handling an event is a single array index
+*/
+
+#define MAX_DEVICES         4           /* -d given more than once, see struct midi_device */
+#define MAPPING_LAYERS      2           /* base and shift */
+#define MAPPING_KIND_CC     0
+#define MAPPING_KIND_NOTE   1
+#define MAPPING_KIND_CC14   2           /* 14 bit cc pair, indexed by its msb controller 0-31 */
+#define MAPPING_KINDS       3           /* kinds in the lookup */
+#define MAPPING_KIND_NRPN   3           /* too many parameters for the lookup, see nrpn_mapping */
+#define MAX_NRPN_MAPPINGS   64
+#define MAX_ACTIONS         65535       /* action indexes are unsigned short */
+#define MAX_GROUPS          32
+#define MAX_GROUP_MEMBERS   12
+#define BODY_SIZE           512         /* json body of one service call, room for a full group */
+#define ENDPOINT_SIZE       100         /* "domain/service" */
+
+enum action_type { ACTION_NONE, ACTION_BRIGHTNESS, ACTION_KELVIN, ACTION_TURN_OFF, ACTION_TOGGLE, ACTION_SHIFT, ACTION_LED };
+
+struct action {
+    enum action_type type;
+    char entity_id[50];                 /* or @name of a group */
+    char endpoint[ENDPOINT_SIZE];
+    char *attribute;                    /* what the action sets, the coalescing key */
+    char body[BODY_SIZE];               /* preformatted json, value actions stop where the number goes */
+    int body_length;
+    struct action_filter {
+        int raw;                        /* last cc value let through by filter_value, -1 for none */
+        int direction;                  /* which way it last moved, 1 or -1, 0 before it did */
+        int output;                     /* last value queued, -1 for none */
+    } filter[MAX_DEVICES];              /* per controller, an action mapped for any device is shared */
+};
+
+/*
+a group is sent as one service call with an entity_id array. it is
+throttled and coalesced as a single entity named @name
+*/
+
+struct group {
+    char name[32];
+    char entity_ids[MAX_GROUP_MEMBERS][50];
+    int count;
+};
+
+struct nrpn_mapping {
+    int device;                         /* -1 for every device */
+    int layer;                          /* -1 for both */
+    int channel;
+    int parameter;                      /* 0-16383 */
+    unsigned short action;
+};
+
+/*
+the lookup is sparse: every device, layer, kind and channel points at a
+block of 128 action indexes, and only the ones with something mapped get
+a block of their own. the others share block 0, which is all unmapped.
+the built in layout answers on every channel by pointing them all at
+channel 0's block. actions grow with the file, so a table is a few
+kilobytes instead of the full 4 * 2 * 3 * 16 * 128 grid
+*/
+
+struct mapping_table {
+    unsigned short lookup[MAX_DEVICES][MAPPING_LAYERS][MAPPING_KINDS][16];      /* index into blocks */
+    unsigned short (*blocks)[128];                                              /* index into actions, 0 is unmapped */
+    int block_count;
+    struct nrpn_mapping nrpn[MAX_NRPN_MAPPINGS];                                /* searched from the end, later lines win */
+    int nrpn_count;
+    struct action *actions;
+    int action_count;
+    int action_capacity;
+    struct group groups[MAX_GROUPS];
+    int group_count;
+};
+
+/*
+global variables
+*/
+
+int debug = false;	                    /* never set, but referenced by userio.c */
+boolean active = false;                 /* set while the midi thread may read the devices */
+char *mapping_file = NULL;
+
+/*
+one process serves up to MAX_DEVICES controllers, one -d each, through
+the same batching, coalescing and throttling. every device has its own
+shift layer, leds and namespace in the mapping table (its position in
+devices), so the same control can drive other lights on each. a device
+that is missing or lost is attached once it shows up, see rescan_devices
+*/
+
+#define DEVICE_RESCAN       2000000         /* micros between looks for missing devices */
+
+/*
+a 14 bit value comes in two 7 bit halves: cc 0-31 carries the msb and
+the same controller + 32 the lsb, for nrpn the parameter is selected
+with cc 99 and 98 and its value sent in cc 6 and 38. the halves are
+paired per device and channel on the midi thread, only for controls
+mapped as cc14 or nrpn. a half that the very next event in the read
+completes waits for it, in either order, anything else is sent at once:
+an msb on its own with a zero lsb like the midi spec says, an lsb on
+its own with the last msb. so a pair never costs more than the event
+it arrived with, and a controller sending only one half still works
+*/
+
+struct value_pair {
+    unsigned char msb, lsb;
+    boolean msb_known;
+    boolean lsb_waiting;                /* the lsb came first, for the msb right behind it */
+};
+
+struct midi_channel_state {
+    struct value_pair cc[32];
+    struct value_pair data;             /* nrpn data entry */
+    int nrpn;                           /* selected parameter, -1 for none or an rpn */
+};
+
+struct midi_device {
+    char *name;
+    char *output_name;                  /* for the leds, NULL for none */
+    PmStream *in;                       /* NULL while not connected */
+    PmStream *out;
+    int seq_client, seq_port;           /* alsa backend: its input port, -1 while not connected */
+    int seq_out_client, seq_out_port;   /* its led port, -1 for none */
+    atomic_int lost;                    /* set by the midi thread when reading fails */
+    boolean reopen;                     /* closed by a rescan only to be opened again, quietly */
+    atomic_int shift;                   /* set while its shift button is held, read by the leds too */
+    unsigned char led_sent[16][128];    /* last value written per channel and control */
+    atomic_uint channels_seen;          /* bit per channel input arrived on, leds go to those */
+    atomic_ulong events;
+    struct midi_channel_state channels[16];     /* midi thread only */
+};
+
+struct midi_device devices[MAX_DEVICES];
+int device_count = 0;
+long long device_rescan_due = 0;
+struct timespec device_nodes_changed;   /* mtime of /dev/snd at the last rescan */
+
+/*
+with the alsa sequencer backend (built with -DM2HA_ALSA -lasound) m2ha
+is a sequencer client, the devices are connected to its input port and
+the leds are sent from its output port. its descriptor is waited on in
+wait_for_work next to the sockets, so input is handled on the main loop
+as soon as it arrives and nothing polls while the desk is untouched.
+plugged in devices are announced by the system client instead of being
+rescanned. portmidi and its polling midi thread remain the fallback
+*/
+
+#ifdef M2HA_ALSA
+char *midi_backend = "alsa";
+snd_seq_t *seq = NULL;
+int seq_input = -1;                     /* our ports */
+int seq_output = -1;
+int seq_fd = -1;
+#else
+char *midi_backend = "portmidi";
+#endif
+boolean use_alsa = false;
+
+/*
+the mapping table is read by the midi thread without locks. a reload
+builds a complete new table and publishes it with one atomic pointer
+swap. the midi thread loads the pointer once per poll and then reports
+the epoch it started under, the old table is freed only once it has
+finished a poll that began after the swap
+*/
+
+_Atomic(struct mapping_table *) mappings = NULL;
+atomic_uint mapping_epoch;              /* bumped by the main thread on every swap or device change */
+atomic_uint midi_thread_epoch;          /* epoch of the last completed poll */
+atomic_ulong midi_events;               /* events handled by the midi thread */
+atomic_ulong midi_collapsed;            /* events superseded by a newer value in the same read */
+
+/*
+fader and knob values pass a filter on the midi thread before they are
+queued. a control turning back must move more than deadband steps, so a
+worn fader flickering between neighbouring values settles. the value is
+then computed at the resolution home assistant keeps (whole percent,
+kelvin in whole mireds) and dropped when it equals the last one queued
+for its action on that controller. the ends of the travel always get
+through. the filter only remembers values that made it into the command
+ring, and lives in the mapping table: a reload starts it afresh
+*/
+
+int deadband = 1;
+atomic_ulong filter_passed;             /* fader values queued */
+atomic_ulong filter_dropped;            /* fader values that were noise or changed nothing */
+volatile sig_atomic_t reload_requested = 0;
+
+/*
+the controller's button leds show the on/off state of the entity mapped
+to each button (turn_off, toggle and led actions, a group is lit when any
+member is on). the main loop renders the leds at most once per LED_FRAME
+and only when something changed, compares them with what was last sent
+and writes just the differences in one Pm_Write. output never runs on
+the midi thread, so input is never held up by it
+*/
+
+#define LED_FRAME           20000           /* micros, 50 frames per second at most */
+#define LED_UNKNOWN         0xff            /* led_sent before the first frame */
+
+char *output_device_name = NULL;        /* for the first device, the others use their input's name */
+atomic_int leds_dirty;                  /* set when entity state or a shift layer changed */
+long long led_frame_due = 0;
+long led_writes = 0;
+
+/*
+record and replay. -r appends every midi event read to a file of fixed
+8 byte records after an 8 byte header, "m2harec" and the format version.
+a record is the portmidi timestamp as 4 bytes little endian, then the
+status, the two data bytes and the device's position, so a recording
+replays the same on any machine. the replay command feeds such a file through the same batch, collapse and
+handle path on the midi thread instead of a device, at the recorded
+pace or -x times faster (0 for one batch per tick), and exits once
+everything it caused has been sent
+*/
+
+#define RECORDING_MAGIC     "m2harec"
+#define RECORDING_VERSION   '2'         /* 1 was host byte order structs */
+#define RECORD_SIZE         8
+
+struct recorded_event {
+    uint32_t timestamp;
+    uint32_t message;                   /* the device's position in the top byte */
+};
+
+FILE *record_file = NULL;
+FILE *replay_file = NULL;
+double replay_speed = 1;
+struct recorded_event replay_next;      /* read ahead, waiting for its time */
+boolean replay_pending = false;
+long long replay_first = -1;            /* recorded timestamp of the first event */
+PtTimestamp replay_start;               /* when the first event was replayed */
+PtTimestamp replay_last_batch = -1;
+atomic_int replay_finished;
+
+/*
+benchmark. the bench command feeds a synthetic cc storm on the mapped
+faders and pots to the same collapse, lookup, ring and coalescing code
+the midi thread and main loop run, sending to whatever -u points at.
+./build.sh bench builds it with malloc wrapped to count allocations
+*/
+
+#define BENCH_MAX_CONTROLS 32
+
+int bench_seconds = 0;
+atomic_ulong bench_allocations;         /* only counted in a -DM2HA_BENCH build */
+
+/*
+the midi thread reads everything portmidi has buffered in one batch and
+collapses it before mapping: when a continuous control (fader, pot) moved
+several times in the batch only its newest value is handled. buttons are
+never collapsed so presses and releases all arrive
+*/
+
+#define MIDI_BATCH_SIZE 256
+
+PmEvent midi_batch[MIDI_BATCH_SIZE];
+unsigned int midi_batch_seen[MAPPING_KINDS * 16 * 128];        /* batch number a control was last seen in */
+unsigned short midi_batch_last[MAPPING_KINDS * 16 * 128];      /* position of that event in the batch */
+unsigned int midi_batch_number = 0;
+volatile sig_atomic_t done = 0;         /* when non zero, exit */;
+
+int wake_fd = -1;                       /* eventfd the main loop sleeps on */
+atomic_int main_loop_waiting;           /* set while the main loop is (about to be) asleep */
+
+int throttle = 100000;                  /* fastest any one entity is sent, see entity_state */
+char *device_name = "nanoKONTROL2 nanoKONTROL2 _ CTR";
+char *api_url = "http://homeassistant.local:8123";
+char *transport = "rest";
+boolean smooth = false;                 /* send brightness and kelvin sweeps with a transition, see flush_api_calls */
+boolean mirror_enabled = true;          /* drop calls that would not change the mirrored state */
+boolean verbose = false;
+
+/*
+api calls are dispatched asynchronously through a curl multi handle.
+a fixed pool of easy handles is created at startup and reused, the multi
+handle keeps their connections alive and shares one dns cache, so the
+lookup, tcp handshake and headers are paid for once. each entity has at
+most one request in flight so its updates arrive in order
+*/
+
+#define API_MAX_IN_FLIGHT 8
+#define API_MAX_MERGE     16            /* entities merged into one call, see flush_api_calls */
+
+struct api_request {
+    CURL *easy;
+    boolean busy;
+    int attempts;
+    int entity_indexes[API_MAX_MERGE];  /* into entities, more than one when merged */
+    int call_indexes[API_MAX_MERGE];    /* into call_queue, to put the values back on failure */
+    long long sequences[API_MAX_MERGE]; /* of those values */
+    int entity_count;
+    long ws_id;                         /* call_service id when sent over the websocket */
+    int status;                         /* http status, 200 or 400 for websocket results, 0 for none */
+    long long started;
+    char entity_id[64];                 /* for logging, "<first> +<n>" when merged */
+    char endpoint[ENDPOINT_SIZE];
+    char body[BODY_SIZE];               /* must outlive the transfer, curl does not copy it */
+    char url[200];                      /* url last given to the handle, api_url_prefix + endpoint */
+    struct timing timing;               /* of the midi event behind this call */
+};
+
+CURLM *api_multi = NULL;
+size_t api_url_prefix_length = 0;       /* length of "<api_url>/api/services/" */
+struct curl_slist *api_headers = NULL;
+struct api_request api_requests[API_MAX_IN_FLIGHT];
+int api_in_flight = 0;
+
+struct api_stats {
+    long requests;
+    long failures;
+    long merged;                        /* updates that rode along in another entity's call */
+    long statuses[6];                   /* responses by http status class, [0] for none */
+    long connects;                      /* new connections opened, the rest reused one */
+    curl_off_t connect_micros;
+    curl_off_t total_micros;
+};
+
+struct api_stats api_stats;
+
+/*
+while home assistant can't be reached (connection refused, timeouts,
+5xx while it restarts) the values of failed calls go back into their
+queue slots unless a newer one was written meanwhile, so every entity
+still ends up at the last value set and the fixed size call queue is
+all the memory an outage takes. sending is held off for a jittered
+exponential backoff, then a single call probes whether it is back and
+the first success releases everything queued. toggles are not put back,
+sending one twice would undo it
+*/
+
+#define RETRY_BACKOFF_MIN       250000
+#define RETRY_BACKOFF_MAX       30000000
+
+struct api_backoff {
+    int failures;                       /* in a row, 0 while reachable */
+    long long retry_at;                 /* no calls before this */
+    long long since;                    /* start of the outage */
+    long outages;
+    long requeued;                      /* values put back after a failed call */
+};
+
+struct api_backoff api_backoff;
+
+/*
+latency histograms, one per pipeline stage. buckets are log-linear
+(16 linear steps per power of two, so within ~6%) over microseconds
+and every counter is atomic so the midi thread records without locks.
+dumped on SIGUSR1 and at exit
+*/
+
+#define HISTOGRAM_SUB_BUCKETS   16
+#define HISTOGRAM_BUCKETS       (HISTOGRAM_SUB_BUCKETS * 40)
+
+enum latency_stage { STAGE_MAPPING, STAGE_RING, STAGE_QUEUE, STAGE_HTTP, STAGE_TOTAL, STAGE_COUNT };
+
+struct histogram {
+    char *name;
+    char *label;                        /* stage label of the metric */
+    atomic_ulong counts[HISTOGRAM_BUCKETS];
+    atomic_ulong samples;
+    atomic_llong sum;
+    atomic_llong max;
+};
+
+struct histogram histograms[STAGE_COUNT] = {
+    { .name = "midi -> enqueue", .label = "mapping" },
+    { .name = "enqueue -> dequeue", .label = "ring" },
+    { .name = "dequeue -> send", .label = "queue" },
+    { .name = "send -> response", .label = "http" },
+    { .name = "midi -> response", .label = "total" },
+};
+
+atomic_ulong updates_coalesced;         /* queued values overwritten by a newer one before sending */
+atomic_ulong updates_dropped;           /* ring or queue full */
+volatile sig_atomic_t stats_requested = 0;
+
+/*
+the websocket transport keeps one authenticated connection to
+/api/websocket open and sends each call as a call_service message.
+replies carry the id of their request and are matched asynchronously.
+nothing about the connection blocks the main loop: the host name is
+resolved on a short lived thread (getaddrinfo has no nonblocking form
+and mdns for homeassistant.local can take seconds) and kept for the
+next connects until one fails, the connect and the upgrade handshake
+run nonblocking and are moved along by ws_progress whenever
+wait_for_work sees the socket ready. from the start of the connect to
+auth_ok it gets WS_CONNECT_TIMEOUT
+*/
+
+#define WS_OPCODE_CONTINUATION  0x0
+#define WS_OPCODE_TEXT          0x1
+#define WS_OPCODE_CLOSE         0x8
+#define WS_OPCODE_PING          0x9
+#define WS_OPCODE_PONG          0xa
+
+#define WS_REPLY_TIMEOUT        5000000
+#define WS_CONNECT_TIMEOUT      5000000
+#define WS_RECONNECT_INTERVAL   2000000
+
+enum ws_state { WS_DISCONNECTED, WS_RESOLVING, WS_CONNECTING, WS_UPGRADING, WS_AUTHENTICATING, WS_READY };
+
+struct websocket {
+    int fd;
+    enum ws_state state;
+    long next_id;
+    long long last_connect_attempt;
+    long long deadline;                 /* the connect must reach auth_ok by then */
+    char host[100];
+    char port[10];
+    atomic_int resolved;                /* set by the resolver thread once it wrote the fields below */
+    int resolve_error;                  /* getaddrinfo's */
+    struct sockaddr_storage address;
+    socklen_t address_length;           /* 0 while unknown */
+    char in[16384];
+    size_t in_length;
+    char out[16384];
+    size_t out_length;
+    char message[16384];                /* text message being reassembled from fragments */
+    size_t message_length;
+    long subscribe_id;                  /* of the last subscribe_trigger sent */
+    boolean subscribed;                 /* its result came back successful */
+};
+
+struct websocket ws = { .fd = -1 };
+boolean use_websocket = false;
+
+/*
+with -p the counters are served in the prometheus text format on
+http://127.0.0.1:<port>/metrics. the listener and its connections are
+nonblocking and waited on in wait_for_work with the other sockets, so a
+scrape is answered on the main loop and never holds up the midi thread.
+a connection is closed after its response, when all are busy the
+oldest is dropped for a new one
+*/
+
+#define METRICS_MAX_CLIENTS     4
+
+struct metrics_client {
+    int fd;                             /* -1 when free */
+    char request[1024];
+    size_t request_length;
+    char *response;                     /* NULL until the request is complete */
+    size_t response_length;
+    size_t sent;
+    long long opened;
+};
+
+int metrics_port = 0;                   /* 0 for no listener */
+int metrics_fd = -1;
+struct metrics_client metrics_clients[METRICS_MAX_CLIENTS];
+long metrics_scrapes = 0;
+
+/*
+every entity gets its own send interval, tuned AIMD style from the
+smoothed round trip time (srtt) and errors of its requests: an error, or
+an srtt above half the interval, doubles it. an srtt below a quarter of
+the interval shortens it by a sixteenth (never below -t), in between it
+is left alone so the interval settles instead of flipping with every
+reply. a slow zigbee bulb then backs off on its own without holding back
+a fast wifi switch. the interval only delays an update, the latest value
+always stays queued until it is sent
+*/
+
+#define MAX_ENTITIES            64
+#define THROTTLE_MAX            2000000
+#define THROTTLE_DECREASE       16          /* a quick entity's interval shrinks by 1/16 per reply */
+#define THROTTLE_MIN_STEP       1000        /* but by at least 1ms */
+
+struct entity_state {
+    char entity_id[50];
+    boolean busy;                       /* a request is in flight */
+    long long interval;                 /* current send interval, micros */
+    long long last_sent;
+    long long srtt;                     /* smoothed round trip time, micros */
+    long sent;
+    long failed;
+    int state;                          /* mirrored from home assistant: 1 on, 0 off, -1 unknown */
+    int brightness_pct;                 /* -1 when unknown */
+    int kelvin;                         /* -1 when unknown */
+    long long pending_until;            /* the echo of our last call is expected until then, 0 when none */
+    int pending_state;                  /* what that call set, -1 for fields it did not touch */
+    int pending_brightness_pct;
+    int pending_kelvin;
+    long long mirrored_at;              /* when an event or our own call last set the mirror */
+};
+
+struct entity_state entities[MAX_ENTITIES];
+int entity_count = 0;
+
+/*
+the state mirror keeps the state of every mapped entity, seeded from
+/api/states and kept current by a state trigger subscription on the
+websocket (opened for this even with the rest transport). a call that
+would leave the entity as it is, eg: turning off a light that is off,
+is dropped. the mirror is only trusted once home assistant confirmed
+the subscription, and never for an entity with a call pending: our own
+calls update the mirror right away and remember the value they set,
+every state event is applied, and the one equal to that value is the
+echo that ends the wait (or MIRROR_ECHO_WINDOW passes without it, eg:
+the call changed nothing). an outside change in the meantime therefore
+lands in the mirror instead of being taken for an echo
+*/
+
+#define MIRROR_ECHO_WINDOW      1000000
+#define MIRROR_KELVIN_TOLERANCE 10          /* home assistant rounds kelvin through mireds */
+
+long mirror_hits = 0;                   /* calls dropped because they would change nothing */
+long mirror_misses = 0;                 /* calls checked against the mirror and sent */
+
+CURL *mirror_seed_easy = NULL;          /* the /api/states transfer while it runs on api_multi */
+char *mirror_seed_states = NULL;        /* its response so far */
+size_t mirror_seed_length = 0;
+long long mirror_seed_started = 0;      /* entities mirrored after this keep their newer state */
+
+/*
+queued api calls are coalesced per (entity, attribute) so each entity only
+keeps its latest value, but moving several controls in the same throttle
+window never drops another entity's update
+*/
+
+#define MAX_QUEUED_CALLS 64
+#define BODY_ENTITY_PREFIX 14           /* strlen("{\"entity_id\": ") */
+
+struct queued_call {
+    int entity;                         /* index into entities */
+    char entity_id[50];
+    char attribute[20];
+    char endpoint[ENDPOINT_SIZE];
+    char body[BODY_SIZE];
+    long long sequence;                 /* order of going dirty, 0 when the slot is clean */
+    int writes;                         /* values written since the slot went dirty */
+    long long last_flushed;             /* when the slot was last sent */
+    struct timing timing;               /* of the first event since the slot went dirty */
+};
+
+struct queued_call call_queue[MAX_QUEUED_CALLS];
+int call_queue_size = 0;
+int call_queue_dirty = 0;
+long long call_sequence = 0;
+
+/*
+commands are handed from the portmidi timer thread to the main thread
+through a bounded single-producer / single-consumer ring of fixed size
+records. the producer never blocks or allocates: when the ring is full
+the command is dropped and counted. head and tail live on their own
+cache lines so the two threads do not false-share
+*/
+
+#define COMMAND_RING_SIZE 256           /* must be a power of two */
+
+struct api_command {
+    char entity_id[50];
+    char attribute[20];
+    char endpoint[ENDPOINT_SIZE];
+    char body[BODY_SIZE];
+    struct timing timing;
+};
+
+struct command_ring {
+    _Alignas(CACHE_LINE_SIZE) atomic_uint head;        /* next slot to write, owned by the producer */
+    unsigned int high_water;                            /* deepest the ring has been, producer only */
+    atomic_ulong overflow;                              /* commands dropped because the ring was full */
+    _Alignas(CACHE_LINE_SIZE) atomic_uint tail;        /* next slot to read, owned by the consumer */
+    _Alignas(CACHE_LINE_SIZE) struct api_command records[COMMAND_RING_SIZE];
+};
+
+struct command_ring command_ring;
+
+/*
+local functions
+*/
+
+private void handle_midi_event(struct midi_device *device, PmEvent *event, PmEvent *next, long long arrived, struct mapping_table *table);
+private boolean decode_wide_value(struct midi_device *device, struct mapping_table *table, int channel, int control, int value, PmEvent *next, struct action **action, int *wide_value);
+private boolean filter_value(struct action_filter *filter, enum action_type type, int value, int max, int *output);
+private void filter_push(struct midi_device *device, struct action *action, int value, int max, struct timing *timing);
+void reload_mappings(void);
+char *channel_to_entity_id(int channel, boolean shift);
+private const struct controller_profile *find_profile(char *device_name);
+private unsigned short lookup_action(struct mapping_table *table, int device, int layer, int kind, int channel, int control);
+private struct mapping_table *new_mapping_table(void);
+private void free_mapping_table(struct mapping_table *table);
+private void reclaim_entities(struct mapping_table *table);
+struct mapping_table *load_default_mappings(void);
+private struct group *find_group(struct mapping_table *table, char *name);
+struct mapping_table *load_mapping_file(char *path);
+int check_mappings(struct mapping_table *table, char *states_path);
+int api_init(void);
+boolean api_send(struct queued_call **calls, int call_count, char *endpoint, char *body, struct timing *timing);
+int api_poll(void);
+private void api_finish(struct api_request *request, boolean success, boolean retry, const char *error, curl_off_t connect_micros, curl_off_t total_micros);
+private void api_unreachable(long long now, const char *error);
+private boolean ws_send(struct api_request *request);
+private void ws_read(void);
+private int ws_flush(void);
+private void ws_close(char *reason);
+private void ws_progress(void);
+void api_cleanup(void);
+void queue_api_call(char *entity_id, char *attribute, char *endpoint, char *body, struct timing *timing);
+boolean push_api_command(struct action *action, int value, struct timing *timing);
+void record_latency(enum latency_stage stage, long long micros);
+void print_stats(void);
+int drain_command_ring(void);
+long long monotonic_micros(void);
+void wake_main_loop(void);
+private void wait_for_work(long long timeout_micros);
+long long flush_api_calls(long long now);
+private char *body_data(char *body);
+void mirror_track(struct mapping_table *table);
+private boolean mirror_drop(struct queued_call *call);
+private void mirror_sent(struct queued_call *call);
+private void mirror_invalidate(struct entity_state *entity);
+private void mirror_subscribe(void);
+private void mirror_seeded(CURLcode response);
+private void mirror_seed_stop(void);
+private void mirror_handle_event(char *message);
+private boolean ws_open(void);
+private long long render_leds(long long now);
+private FILE *open_recording(char *path, char *mode);
+private int replay_read(PmEvent *buffer, int length, int *slot);
+private boolean wait_for_midi_thread(void);
+private int attach_devices(void);
+private void close_device(struct midi_device *device, boolean dark);
+private void reset_input_state(struct midi_device *device);
+private long long rescan_devices(long long now);
+#ifdef M2HA_ALSA
+private int alsa_open(void);
+private void alsa_read(void);
+private void alsa_write_leds(struct midi_device *device, PmEvent *batch, int count);
+#endif
+private int metrics_open(void);
+private void metrics_poll(void);
+private void metrics_close(void);
+private void run_bench(int seconds);
+private void leds_off(struct midi_device *device);
+private void merge_bodies(char *out, struct queued_call **calls, int count);
+int find_entity(char *entity_id);
+
+
+private int midi_event_kind(PmMessage message) {
+    switch (Pm_MessageStatus(message) & MIDI_CODE_MASK) {
+        case MIDI_CONTROL_CHANGE: return MAPPING_KIND_CC;
+        case MIDI_NOTE_ON:
+        case MIDI_NOTE_OFF: return MAPPING_KIND_NOTE;
+        default: return -1;
+    }
+}
+
+
+private void collapse_midi_batch(struct midi_device *device, PmEvent *events, int count, struct mapping_table *table) {
+
+    /*
+    one pass over the batch: an event on a continuous control clears
+    (message = 0) the earlier event of the same control. a shift change
+    starts a new run, since the same control maps to another entity
+    on the other side of it
+    */
+
+    boolean layer = atomic_load_explicit(&device->shift, memory_order_relaxed);
+    int i;
+
+    midi_batch_number++;
+
+    for (i = 0; i < count; i++) {
+        PmMessage message = events[i].message;
+        int kind = midi_event_kind(message);
+        if (kind < 0) continue;
+
+        int channel = Pm_MessageStatus(message) & MIDI_CHN_MASK;
+        int control = Pm_MessageData1(message);
+        int index = lookup_action(table, device - devices, layer, kind, channel, control);
+        enum action_type type = table->actions[index].type;
+
+        if (type == ACTION_SHIFT) {
+            layer = Pm_MessageData2(message) == 127;
+            midi_batch_number++;
+            continue;
+        }
+        if (type != ACTION_BRIGHTNESS && type != ACTION_KELVIN) continue;
+
+        int key = (kind * 16 + channel) * 128 + control;
+        if (midi_batch_seen[key] == midi_batch_number) {
+            events[midi_batch_last[key]].message = 0;
+            atomic_fetch_add_explicit(&midi_collapsed, 1, memory_order_relaxed);
+        }
+        midi_batch_seen[key] = midi_batch_number;
+        midi_batch_last[key] = i;
+    }
+}
+
+
+private void handle_midi_batch(struct midi_device *device, int count, struct mapping_table *table) {
+
+    long long arrived = monotonic_micros();
+    collapse_midi_batch(device, midi_batch, count, table);
+
+    int i;
+    for (i = 0; i < count; i++) {
+        if (midi_batch[i].message != 0) handle_midi_event(device, &midi_batch[i], i + 1 < count ? &midi_batch[i + 1] : NULL, arrived, table);
+    }
+    atomic_fetch_add_explicit(&midi_events, count, memory_order_relaxed);
+    atomic_fetch_add_explicit(&device->events, count, memory_order_relaxed);
+}
+
+
+private void record_midi(int slot, PmEvent *events, int count) {
+    unsigned char records[MIDI_BATCH_SIZE][RECORD_SIZE];
+    int i, j;
+    for (i = 0; i < count; i++) {
+        uint32_t timestamp = events[i].timestamp;
+        for (j = 0; j < 4; j++) records[i][j] = timestamp >> (8 * j) & 0xff;
+        records[i][4] = Pm_MessageStatus(events[i].message);
+        records[i][5] = Pm_MessageData1(events[i].message);
+        records[i][6] = Pm_MessageData2(events[i].message);
+        records[i][7] = slot;
+    }
+    fwrite(records, RECORD_SIZE, count, record_file);
+}
+
+
+void poll_midi_device(PtTimestamp timestamp, void *userData) {
+    int count, d = 0;
+    unsigned int epoch = atomic_load(&mapping_epoch);
+    struct mapping_table *table = atomic_load_explicit(&mappings, memory_order_acquire);
+
+    if (active && replay_file) {
+        while ((count = replay_read(midi_batch, MIDI_BATCH_SIZE, &d))) handle_midi_batch(&devices[d], count, table);
+
+    } else if (active) {
+        for (d = 0; d < device_count; d++) {
+            struct midi_device *device = &devices[d];
+            if (device->in == NULL || atomic_load_explicit(&device->lost, memory_order_relaxed)) continue;
+
+            while ((count = Pm_Read(device->in, midi_batch, MIDI_BATCH_SIZE))) {
+                if (count == pmBufferOverflow) {
+                    fprintf(stderr, "%s: %s\n", device->name, Pm_GetErrorText(count));
+                    break;
+                }
+                if (count < 0) {
+                    /* unplugged, the main loop closes it and waits for it to come back */
+                    fprintf(stderr, "%s: %s\n", device->name, Pm_GetErrorText(count));
+                    atomic_store(&device->lost, 1);
+                    if (atomic_exchange(&main_loop_waiting, 0)) wake_main_loop();
+                    break;
+                }
+
+                if (record_file) record_midi(d, midi_batch, count);
+                handle_midi_batch(device, count, table);
+            }
+        }
+    }
+
+    /* done with table, let a pending reload free it */
+    atomic_store_explicit(&midi_thread_epoch, epoch, memory_order_release);
+}
+
+
+private FILE *open_recording(char *path, char *mode) {
+
+    /* open a recording for reading or writing, checking or writing its header */
+
+    char header[8];
+    FILE *file = fopen(path, mode[0] == 'r' ? "rb" : "wb");
+    if (file == NULL) {
+        fprintf(stderr, "could not open recording '%s'\n", path);
+        return NULL;
+    }
+
+    if (mode[0] == 'w') {
+        fwrite(RECORDING_MAGIC, 1, 7, file);
+        fputc(RECORDING_VERSION, file);
+        return file;
+    }
+
+    if (fread(header, 1, 8, file) != 8 || memcmp(header, RECORDING_MAGIC, 7) != 0) {
+        fprintf(stderr, "'%s' is not a recording\n", path);
+    } else if (header[7] != RECORDING_VERSION) {
+        fprintf(stderr, "'%s' is a version %c recording, this m2ha reads version %c. record it again\n",
+            path, header[7], RECORDING_VERSION);
+    } else {
+        return file;
+    }
+    fclose(file);
+    return NULL;
+}
+
+
+private int replay_read(PmEvent *buffer, int length, int *slot) {
+
+    /*
+    the recorded events that are due, stamped with the current time, up
+    to the first one of another device. at most one batch per timer tick,
+    like a device would deliver them
+    */
+
+    PtTimestamp now = Pt_Time();
+    int count = 0;
+
+    if (now == replay_last_batch) return 0;
+
+    while (count < length) {
+        if (!replay_pending) {
+            unsigned char record[RECORD_SIZE];
+            if (fread(record, RECORD_SIZE, 1, replay_file) != 1) {
+                /* finished once the last batch was handled, ie: on the call after it */
+                if (count == 0 && !atomic_exchange(&replay_finished, 1) && atomic_exchange(&main_loop_waiting, 0)) wake_main_loop();
+                break;
+            }
+            replay_next.timestamp = record[0] | record[1] << 8 | record[2] << 16 | (uint32_t)record[3] << 24;
+            replay_next.message = Pm_Message(record[4], record[5], record[6]) | (uint32_t)record[7] << 24;
+            replay_pending = true;
+            if (replay_first < 0) {
+                replay_first = replay_next.timestamp;
+                replay_start = now;
+            }
+        }
+
+        if (replay_speed > 0 && (now - replay_start) * replay_speed < replay_next.timestamp - replay_first) break;
+
+        int device = (uint32_t)replay_next.message >> 24;
+        if (count > 0 && device != *slot) break;
+        replay_pending = false;
+        if (device >= device_count) continue;   /* recorded with more -d than given now */
+
+        *slot = device;
+        buffer[count].message = replay_next.message & 0xffffff;
+        buffer[count].timestamp = now;
+        count++;
+    }
+
+    if (count > 0) replay_last_batch = now;
+    return count;
+}
+
+
+void reload_handler(int dummy) {
+    reload_requested = 1;
+    wake_main_loop();
+}
+
+
+void stats_handler(int dummy) {
+    stats_requested = 1;
+    wake_main_loop();
+}
+
+
+void interrupt_handler(int dummy) {
+    done = 1;
+    wake_main_loop();
+    printf("Caught signal %d\n", dummy);
+}
+
+
+void help_menu(int exit_code) {
+    puts("Usage: mm -dt [run|list] ");
+    puts("Commands:");
+    puts("  run                     Start the MIDI monitor. Send SIGHUP to reload the mapping file,");
+    puts("                          SIGUSR1 to print latency statistics.");
+    puts("  list                    List available MIDI devices.");
+    puts("  check [states.json]     Validate the mapped entity ids against a dump of /api/states.");
+    puts("  replay <recording>      Run a recording made with -r instead of reading the MIDI device, then exit.");
+    puts("  bench [seconds]         Send a synthetic CC storm through the mappings and report throughput. Default: 5");
+    puts("  help                    Show this help message.");
+    puts("Options:");
+    printf("  -d <device_name>        MIDI device to read, repeat for up to %d controllers. Default: '%s'\n", MAX_DEVICES, device_name);
+    puts("  -m <mapping_file>       Load control mappings from a file. Default: built in nanoKONTROL2 layout");
+    printf("  -M <alsa|portmidi>      MIDI backend, alsa needs a build with -DM2HA_ALSA. Default: %s\n", midi_backend);
+    puts("  -o <device_name|none>   MIDI output for the first device's button leds. Default: same name as its input");
+    printf("  -D <steps>              Fader deadband: a fader or knob turning back must move more than this. Default: %d\n", deadband);
+    puts("  -N                      No state mirror: send every call, even when it would change nothing.");
+    puts("  -p <port>               Serve prometheus metrics on http://127.0.0.1:<port>/metrics.");
+    puts("  -s                      Smooth fader sweeps: brightness and kelvin changes fade over the throttle interval.");
+    printf("  -t <throttle>           Minimum interval between API calls to one entity in microseconds. Default: %d\n", throttle);
+    printf("  -u <url>                Home Assistant base url. Default: '%s'\n", api_url);
+    printf("  -T <rest|websocket>     Transport used for service calls. Default: %s\n", transport);
+    puts("  -r <recording>          Record every MIDI event read to a file, for replay.");
+    puts("  -v                      Print connect and total time of each API call.");
+    puts("  -x <speed>              Replay speed, 2 is twice as fast, 0 as fast as possible. Default: 1");
+    exit(exit_code);
+}
+
+/*
+main
+*/
+
+int main(int argc, char **argv) {
+
+    /*
+    parse cli arguments
+    */
+
+    int opt, i;
+    char *command;
+
+    while ((opt = getopt(argc, argv, "d:D:m:M:No:p:r:st:u:T:vx:")) != -1) {
+        switch (opt) {
+            case 'd':
+                if (device_count == MAX_DEVICES) {
+                    printf("At most %d devices.\n", MAX_DEVICES);
+                    help_menu(1);
+                }
+                devices[device_count++].name = optarg;
+                break;
+            case 'm':
+                mapping_file = optarg;
+                break;
+            case 'D':
+                deadband = atoi(optarg);
+                break;
+            case 'M':
+                midi_backend = optarg;
+                break;
+            case 'p':
+                metrics_port = atoi(optarg);
+                if (metrics_port <= 0 || metrics_port > 65535) {
+                    printf("Invalid metrics port '%s'.\n", optarg);
+                    help_menu(1);
+                }
+                break;
+            case 'N':
+                mirror_enabled = false;
+                break;
+            case 'o':
+                output_device_name = optarg;
+                break;
+            case 'r':
+                record_file = open_recording(optarg, "w");
+                if (record_file == NULL) exit(1);
+                break;
+            case 's':
+                smooth = true;
+                break;
+            case 't':
+                throttle = atoi(optarg);
+                break;
+            case 'u':
+                api_url = optarg;
+                break;
+            case 'T':
+                transport = optarg;
+                break;
+            case 'v':
+                verbose = true;
+                break;
+            case 'x':
+                replay_speed = atof(optarg);
+                break;
+            case '?':
+                help_menu(1);
+                return 1;
+        }
+    }
+
+    if (optind < argc) {
+        command = argv[optind];
+    }else {
+        printf("No command provided.\n");
+        help_menu(1);
+    }
+
+    if (strcmp(command, "help") == 0 || strcmp(command, "--help") == 0 || strcmp(command, "-h") == 0) {
+        help_menu(0);
+    }
+
+    if (device_count == 0) devices[device_count++].name = device_name;
+    for (i = 0; i < device_count; i++) {
+        devices[i].output_name = devices[i].name;
+        devices[i].seq_port = -1;
+        devices[i].seq_out_port = -1;
+        reset_input_state(&devices[i]);
+    }
+    if (output_device_name) devices[0].output_name = output_device_name;
+    if (output_device_name && strcmp(output_device_name, "none") == 0) {
+        for (i = 0; i < device_count; i++) devices[i].output_name = NULL;
+    }
+
+#ifdef M2HA_ALSA
+    if (strcmp(midi_backend, "alsa") != 0 && strcmp(midi_backend, "portmidi") != 0) {
+#else
+    if (strcmp(midi_backend, "portmidi") != 0) {
+#endif
+        printf("Unknown or not built in midi backend '%s'.\n", midi_backend);
+        help_menu(1);
+    }
+
+    if (strcmp(transport, "websocket") == 0) {
+        use_websocket = true;
+    } else if (strcmp(transport, "rest") != 0) {
+        printf("Unknown transport '%s'.\n", transport);
+        help_menu(1);
+    }
+
+    /*
+    load mappings
+    */
+
+    struct mapping_table *table = mapping_file ? load_mapping_file(mapping_file) : load_default_mappings();
+    if (table == NULL) exit(1);
+    atomic_store(&mappings, table);
+
+    if (strcmp(command, "check") == 0) {
+        exit(check_mappings(table, optind + 1 < argc ? argv[optind + 1] : "states.json") ? 1 : 0);
+    }
+
+    if (strcmp(command, "replay") == 0) {
+        if (optind + 1 >= argc) {
+            printf("replay needs a recording.\n");
+            help_menu(1);
+        }
+        replay_file = open_recording(argv[optind + 1], "r");
+        if (replay_file == NULL) exit(1);
+    }
+
+    if (strcmp(command, "bench") == 0) {
+        bench_seconds = optind + 1 < argc ? atoi(argv[optind + 1]) : 5;
+        if (bench_seconds <= 0) help_menu(1);
+    }
+
+    /* replay and bench feed the midi path themselves */
+    boolean use_device = replay_file == NULL && bench_seconds == 0;
+
+    /* 
+    list input devices
+    */
+
+#ifdef M2HA_ALSA
+    if (use_device && strcmp(command, "list") != 0 && strcmp(midi_backend, "alsa") == 0) {
+        use_alsa = alsa_open() == 0;
+        if (!use_alsa) printf("Falling back to portmidi.\n");
+    }
+#endif
+
+    /* porttime only keeps the time without a callback, there is no midi thread with alsa */
+    Pt_Start(1, use_alsa ? NULL : poll_midi_device, 0);
+
+    if (strcmp(command, "list") == 0) {
+        puts("MIDI input devices:");
+        for (i = 0; i < Pm_CountDevices(); i++) {
+            const PmDeviceInfo *info = Pm_GetDeviceInfo(i);
+            if (info->input) printf("  %d) '%s'\n", i, info->name);
+        }
+        Pt_Stop();
+        exit(0);
+    }
+
+    /*
+    init api
+    */
+
+    if (api_init() != 0) {
+        Pt_Stop();
+        exit(1);
+    }
+
+    /* the subscription and seed of the state mirror complete in the main loop */
+    if (mirror_enabled && strncmp(api_url, "https", 5) == 0) {
+        fprintf(stderr, "state mirror needs the websocket api, which is not supported over https, disabled\n");
+        mirror_enabled = false;
+    }
+    if (mirror_enabled) {
+        mirror_track(table);
+        ws_open();
+    }
+
+    /* 
+    init midi 
+    */
+
+    if (use_device) {
+        if (!use_alsa) attach_devices();
+        for (i = 0; i < device_count; i++) {
+            if (devices[i].in == NULL && devices[i].seq_port < 0) printf("Could not find device '%s', waiting for it.\n", devices[i].name);
+        }
+    } else if (replay_file) {
+        printf("Replaying %s at %gx\n", argv[optind + 1], replay_speed);
+    }
+    printf("Midi Monitor ready. (pid: %d) (Control+C to exit)\n", getpid());
+    active = bench_seconds == 0;
+
+    /* 
+    main loop 
+    */
+
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd == -1) {
+        perror("eventfd");
+        exit(1);
+    }
+    if (metrics_port && metrics_open() != 0) exit(1);
+
+    signal(SIGINT, interrupt_handler);
+    signal(SIGTERM, interrupt_handler);
+    signal(SIGHUP, reload_handler);
+    signal(SIGUSR1, stats_handler);
+
+    if (bench_seconds > 0) {
+        run_bench(bench_seconds);
+        done = 1;
+    }
+
+    while (!done) {
+
+        /*
+        
+        this is the main loop of the program,
+        it checks for queued messages and sends them to the api
+        once the throttle interval of their entity has passed.
+        this throttle prevents the server from being overloaded with requests,
+        but ensures the last value input from the user is sent to the api.
+
+        between flushes the loop sleeps until the midi thread wakes it
+        with new work, an http transfer makes progress or the next
+        entity's throttle deadline expires.
+        
+        */
+
+        if (reload_requested) {
+            reload_requested = 0;
+            reload_mappings();
+        }
+
+        if (stats_requested) {
+            stats_requested = 0;
+            print_stats();
+        }
+
+#ifdef M2HA_ALSA
+        if (use_alsa) alsa_read();
+#endif
+        drain_command_ring();
+        api_poll();
+        if (metrics_fd != -1) metrics_poll();
+
+        long long now = monotonic_micros();
+        long long timeout = flush_api_calls(now);
+        long long led_timeout = render_leds(now);
+        if (led_timeout >= 0 && (timeout < 0 || led_timeout < timeout)) timeout = led_timeout;
+        long long rescan_timeout = use_device && !use_alsa ? rescan_devices(now) : -1;
+        if (rescan_timeout >= 0 && (timeout < 0 || rescan_timeout < timeout)) timeout = rescan_timeout;
+
+        /* a replay is over once the recording ran out and everything it queued was answered */
+        if (replay_file && atomic_load(&replay_finished) && call_queue_dirty == 0 && api_in_flight == 0 &&
+                atomic_load(&command_ring.head) == atomic_load(&command_ring.tail)) {
+            printf("Replay finished.\n");
+            break;
+        }
+
+        wait_for_work(timeout);
+    }
+
+    /* 
+    clean up and exit 
+    */
+
+    printf("Midi Monitor exiting.\n");
+    active = false;
+    wait_for_midi_thread();
+    for (i = 0; i < device_count; i++) close_device(&devices[i], true);
+#ifdef M2HA_ALSA
+    if (seq) snd_seq_close(seq);
+#endif
+    Pt_Stop();
+    if (record_file) fclose(record_file);
+    if (replay_file) fclose(replay_file);
+    close(wake_fd);
+    metrics_close();
+    api_cleanup();
+
+    print_stats();
+    Pm_Terminate();
+
+    return 0;
+
+}
+
+
+private void handle_midi_event(struct midi_device *device, PmEvent *event, PmEvent *next, long long arrived, struct mapping_table *table) {
+
+    /*
+    this function handles incoming midi events,
+    it looks the message up in the mapping table and pushes the
+    resulting api call onto the command ring for the main thread
+    to coalesce and send
+    */
+
+    PmMessage data = event->message;
+    int midi_command;
+    int midi_channel;
+    int midi_control;
+    int midi_value;
+    int kind;
+
+    midi_command = Pm_MessageStatus(data) & MIDI_CODE_MASK;
+    midi_channel = Pm_MessageStatus(data) & MIDI_CHN_MASK;
+    midi_control = Pm_MessageData1(data);
+    midi_value = Pm_MessageData2(data);
+
+    if (midi_command == MIDI_CONTROL_CHANGE) {
+        kind = MAPPING_KIND_CC;
+    } else if (midi_command == MIDI_NOTE_ON) {
+        kind = MAPPING_KIND_NOTE;
+    } else if (midi_command == MIDI_NOTE_OFF) {
+        kind = MAPPING_KIND_NOTE;
+        midi_value = 0;
+    } else {
+        return;
+    }
+
+    unsigned int channel_bit = 1u << midi_channel;
+    if (!(atomic_load_explicit(&device->channels_seen, memory_order_relaxed) & channel_bit)) {
+        atomic_fetch_or(&device->channels_seen, channel_bit);
+        atomic_store(&leds_dirty, 1);
+    }
+
+    struct timing timing = { .timestamp = event->timestamp, .arrived = arrived };
+
+    struct action *wide = NULL;
+    int wide_value;
+    if (kind == MAPPING_KIND_CC && decode_wide_value(device, table, midi_channel, midi_control, midi_value, next, &wide, &wide_value)) {
+        if (wide) filter_push(device, wide, wide_value, 16383, &timing);
+        return;
+    }
+
+    int layer = atomic_load_explicit(&device->shift, memory_order_relaxed);
+    int index = lookup_action(table, device - devices, layer, kind, midi_channel, midi_control);
+    if (index == 0) return;
+
+    struct action *action = &table->actions[index];
+
+    switch (action->type) {
+        case ACTION_BRIGHTNESS:
+        case ACTION_KELVIN:
+            filter_push(device, action, midi_value, 127, &timing);
+            break;
+
+        case ACTION_TURN_OFF:
+        case ACTION_TOGGLE:
+            /* buttons fire on release */
+            if (midi_value == 127) break;
+            push_api_command(action, 0, &timing);
+            break;
+
+        case ACTION_SHIFT:
+            atomic_store_explicit(&device->shift, midi_value == 127, memory_order_relaxed);
+            /* the leds follow the layer, published by the store of leds_dirty */
+            atomic_store(&leds_dirty, 1);
+            if (atomic_exchange(&main_loop_waiting, 0)) wake_main_loop();
+            break;
+
+        default:
+            break;
+    }
+}
+
+
+private boolean pair_half(struct value_pair *pair, boolean msb, int value, boolean other_half_next, int *wide_value) {
+
+    /* store one half, returns true with the 14 bit value when there is one to send */
+
+    if (msb) {
+        pair->msb = value;
+        pair->msb_known = true;
+        if (other_half_next) return false;
+        if (!pair->lsb_waiting) pair->lsb = 0;
+        pair->lsb_waiting = false;
+    } else {
+        pair->lsb = value;
+        pair->lsb_waiting = other_half_next;
+        if (other_half_next || !pair->msb_known) return false;
+    }
+    *wide_value = pair->msb << 7 | pair->lsb;
+    return true;
+}
+
+
+private struct action *find_nrpn_action(struct mapping_table *table, int device, int layer, int channel, int parameter) {
+    int i;
+    for (i = table->nrpn_count - 1; i >= 0; i--) {
+        struct nrpn_mapping *mapping = &table->nrpn[i];
+        if (mapping->parameter == parameter && mapping->channel == channel &&
+                (mapping->device == -1 || mapping->device == device) && (mapping->layer == -1 || mapping->layer == layer)) {
+            return &table->actions[mapping->action];
+        }
+    }
+    return NULL;
+}
+
+
+private boolean decode_wide_value(struct midi_device *device, struct mapping_table *table, int channel, int control, int value, PmEvent *next, struct action **action, int *wide_value) {
+
+    /*
+    the 14 bit stage described with value_pair. returns false for a cc
+    that is not part of a mapped pair, which is then handled as usual.
+    otherwise sets action when the event completed a value to send
+    */
+
+    struct midi_channel_state *state = &device->channels[channel];
+    int d = device - devices;
+    int layer = atomic_load_explicit(&device->shift, memory_order_relaxed);
+    int partner;
+    boolean msb;
+
+    int index = control < 64 ? lookup_action(table, d, layer, MAPPING_KIND_CC14, channel, control & 31) : 0;
+    if (index != 0) {
+        int pair = control & 31;
+        msb = control < 32;
+        partner = msb ? control + 32 : control - 32;
+        boolean other_half_next = next && next->message != 0 &&
+            Pm_MessageStatus(next->message) == (MIDI_CONTROL_CHANGE | channel) && Pm_MessageData1(next->message) == partner;
+        if (pair_half(&state->cc[pair], msb, value, other_half_next, wide_value)) *action = &table->actions[index];
+        return true;
+    }
+
+    if (table->nrpn_count == 0) return false;
+
+    switch (control) {
+        case 99:
+            state->nrpn = (value << 7) | (state->nrpn >= 0 ? state->nrpn & 127 : 0);
+            state->data.msb_known = false;
+            state->data.lsb_waiting = false;
+            return true;
+        case 98:
+            state->nrpn = (state->nrpn >= 0 ? state->nrpn & ~127 : 0) | value;
+            state->data.msb_known = false;
+            state->data.lsb_waiting = false;
+            return true;
+        case 101:
+        case 100:
+            state->nrpn = -1;
+            return true;
+        case 6:
+        case 38:
+            if (state->nrpn < 0 || state->nrpn == 16383) return false;        /* an rpn, or the null parameter */
+            msb = control == 6;
+            partner = msb ? 38 : 6;
+            boolean other_half_next = next && next->message != 0 &&
+                Pm_MessageStatus(next->message) == (MIDI_CONTROL_CHANGE | channel) && Pm_MessageData1(next->message) == partner;
+            if (pair_half(&state->data, msb, value, other_half_next, wide_value)) {
+                *action = find_nrpn_action(table, d, layer, channel, state->nrpn);
+            }
+            return true;
+        default:
+            return false;
+    }
+}
+
+
+private boolean filter_value(struct action_filter *filter, enum action_type type, int value, int max, int *output) {
+
+    /*
+    the deadband and change filter described with deadband, for a 7 bit
+    (max 127) or 14 bit (max 16383) value. sets output to the
+    brightness_pct or kelvin to send. midi thread only
+    */
+
+    int moved = filter->raw < 0 ? 0 : value - filter->raw;
+    int direction = moved > 0 ? 1 : -1;
+
+    if (filter->raw >= 0 && value != 0 && value != max) {
+        boolean turned = filter->direction != 0 && direction != filter->direction;
+        if (moved == 0 || (turned && moved * direction <= deadband * (max / 127))) {
+            atomic_fetch_add_explicit(&filter_dropped, 1, memory_order_relaxed);
+            return false;
+        }
+    }
+    filter->raw = value;
+    if (moved != 0) filter->direction = direction;
+
+    float percent = (float)value / max;
+    if (type == ACTION_BRIGHTNESS) {
+        *output = (int)(percent * 100);
+    } else {
+        int kelvin = (int)(2000 + (percent * (6493 - 2000)));
+        int mireds = (1000000 + kelvin / 2) / kelvin;
+        *output = (1000000 + mireds / 2) / mireds;
+        if (*output > 6493) *output = 6493;
+    }
+
+    if (*output == filter->output) {
+        atomic_fetch_add_explicit(&filter_dropped, 1, memory_order_relaxed);
+        return false;
+    }
+    filter->output = *output;
+    atomic_fetch_add_explicit(&filter_passed, 1, memory_order_relaxed);
+    return true;
+}
+
+
+private void filter_push(struct midi_device *device, struct action *action, int value, int max, struct timing *timing) {
+
+    /*
+    filter a fader or knob value and queue it. when the ring overflows
+    the filter forgets the value again, so the same value sent next (eg:
+    by the fader coming to rest) is not taken for a repeat and dropped
+    */
+
+    struct action_filter *filter = &action->filter[device - devices];
+    struct action_filter saved = *filter;
+    int output;
+
+    if (filter_value(filter, action->type, value, max, &output) && !push_api_command(action, output, timing)) *filter = saved;
+}
+
+
+private void copy_field(char *dest, char *src, size_t size) {
+
+    /* bounded copy without strncpy's zero fill of the rest of dest */
+
+    size_t length = strnlen(src, size - 1);
+    memcpy(dest, src, length);
+    dest[length] = '\0';
+}
+
+
+private void render_body(char *out, struct action *action, int value) {
+
+    /*
+    copy the body preformatted by add_mapping and patch the value in,
+    so the midi thread never runs printf. out holds BODY_SIZE bytes
+    */
+
+    int length = action->body_length;
+    memcpy(out, action->body, length);
+
+    if (action->type == ACTION_BRIGHTNESS || action->type == ACTION_KELVIN) {
+        char digits[12];
+        int count = 0;
+        do {
+            digits[count++] = '0' + value % 10;
+            value /= 10;
+        } while (value > 0);
+        while (count > 0) out[length++] = digits[--count];
+        out[length++] = '}';
+    }
+
+    out[length] = '\0';
+}
+
+
+boolean push_api_command(struct action *action, int value, struct timing *timing) {
+
+    /*
+    called from the portmidi thread only. the record is rendered in place
+    and only then published by the release store of head, so the consumer
+    never sees a partially written command and nothing is built twice
+    */
+
+    unsigned int head = atomic_load_explicit(&command_ring.head, memory_order_relaxed);
+    unsigned int tail = atomic_load_explicit(&command_ring.tail, memory_order_acquire);
+
+    if (head - tail == COMMAND_RING_SIZE) {
+        atomic_fetch_add_explicit(&command_ring.overflow, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&updates_dropped, 1, memory_order_relaxed);
+        return false;
+    }
+
+    struct api_command *record = &command_ring.records[head & (COMMAND_RING_SIZE - 1)];
+    copy_field(record->entity_id, action->entity_id, sizeof(record->entity_id));
+    copy_field(record->attribute, action->attribute, sizeof(record->attribute));
+    copy_field(record->endpoint, action->endpoint, sizeof(record->endpoint));
+    render_body(record->body, action, value);
+    record->timing = *timing;
+    record->timing.enqueued = monotonic_micros();
+    record_latency(STAGE_MAPPING, record->timing.enqueued - record->timing.arrived);
+
+    atomic_store_explicit(&command_ring.head, head + 1, memory_order_seq_cst);
+
+    if (head + 1 - tail > command_ring.high_water) command_ring.high_water = head + 1 - tail;
+
+    /* only pay for the syscall when the main loop is asleep */
+    if (atomic_exchange(&main_loop_waiting, 0)) wake_main_loop();
+    return true;
+}
+
+
+int drain_command_ring(void) {
+
+    /*
+    called from the main thread only, moves every published command
+    into the coalescing table and returns how many were read
+    */
+
+    unsigned int tail = atomic_load_explicit(&command_ring.tail, memory_order_relaxed);
+    unsigned int head = atomic_load_explicit(&command_ring.head, memory_order_acquire);
+    int count = 0;
+
+    while (tail != head) {
+        struct api_command *record = &command_ring.records[tail & (COMMAND_RING_SIZE - 1)];
+        record->timing.dequeued = monotonic_micros();
+        record_latency(STAGE_RING, record->timing.dequeued - record->timing.enqueued);
+        queue_api_call(record->entity_id, record->attribute, record->endpoint, record->body, &record->timing);
+        tail++;
+        count++;
+        atomic_store_explicit(&command_ring.tail, tail, memory_order_release);
+    }
+
+    return count;
+}
+
+
+long long monotonic_micros(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+
+private int histogram_bucket(long long micros) {
+    if (micros < HISTOGRAM_SUB_BUCKETS) return micros < 0 ? 0 : micros;
+
+    int magnitude = 63 - __builtin_clzll(micros);          /* >= 4 */
+    int sub = (micros >> (magnitude - 4)) & (HISTOGRAM_SUB_BUCKETS - 1);
+    int bucket = (magnitude - 3) * HISTOGRAM_SUB_BUCKETS + sub;
+    return bucket < HISTOGRAM_BUCKETS ? bucket : HISTOGRAM_BUCKETS - 1;
+}
+
+
+private long long histogram_bucket_max(int bucket) {
+    if (bucket < HISTOGRAM_SUB_BUCKETS) return bucket;
+
+    int magnitude = bucket / HISTOGRAM_SUB_BUCKETS + 3;
+    long long sub = bucket % HISTOGRAM_SUB_BUCKETS;
+    return ((HISTOGRAM_SUB_BUCKETS + sub + 1) << (magnitude - 4)) - 1;
+}
+
+
+void record_latency(enum latency_stage stage, long long micros) {
+
+    /* lock free, safe to call from the midi thread and the main thread */
+
+    struct histogram *histogram = &histograms[stage];
+    atomic_fetch_add_explicit(&histogram->counts[histogram_bucket(micros)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->samples, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->sum, micros, memory_order_relaxed);
+
+    long long max = atomic_load_explicit(&histogram->max, memory_order_relaxed);
+    while (micros > max && !atomic_compare_exchange_weak(&histogram->max, &max, micros));
+}
+
+
+private long long histogram_percentile(struct histogram *histogram, double percentile) {
+    unsigned long samples = atomic_load(&histogram->samples);
+    unsigned long target = (unsigned long)(samples * percentile + 0.5);
+    unsigned long seen = 0;
+    int i;
+
+    long long max = atomic_load(&histogram->max);
+
+    if (target == 0) target = 1;
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += atomic_load_explicit(&histogram->counts[i], memory_order_relaxed);
+        if (seen >= target) return histogram_bucket_max(i) < max ? histogram_bucket_max(i) : max;
+    }
+    return max;
+}
+
+
+void print_stats(void) {
+    int i;
+
+    printf("latency (us)          samples        p50        p99        max\n");
+    for (i = 0; i < STAGE_COUNT; i++) {
+        struct histogram *histogram = &histograms[i];
+        unsigned long samples = atomic_load(&histogram->samples);
+        if (samples == 0) {
+            printf("%-20s %8lu          -          -          -\n", histogram->name, samples);
+            continue;
+        }
+        printf("%-20s %8lu %10lld %10lld %10lld\n", histogram->name, samples,
+            histogram_percentile(histogram, 0.50), histogram_percentile(histogram, 0.99), atomic_load(&histogram->max));
+    }
+
+    printf("midi: %lu events, %lu collapsed\n", atomic_load(&midi_events), atomic_load(&midi_collapsed));
+    for (i = 0; device_count > 1 && i < device_count; i++) {
+        printf("  %s: %lu events\n", devices[i].name, atomic_load(&devices[i].events));
+    }
+    unsigned long filtered = atomic_load(&filter_dropped);
+    unsigned long faders = filtered + atomic_load(&filter_passed);
+    printf("filter: %lu of %lu fader values dropped (%.1f%%)\n", filtered, faders, faders ? 100.0 * filtered / faders : 0.0);
+    printf("updates: %lu coalesced, %ld merged, %lu dropped\n",
+        atomic_load(&updates_coalesced), api_stats.merged, atomic_load(&updates_dropped));
+    printf("command ring: %u/%d high water, %lu overflowed\n",
+        command_ring.high_water, COMMAND_RING_SIZE, atomic_load(&command_ring.overflow));
+
+    if (api_backoff.outages) {
+        printf("outages: %ld, %ld values queued again%s\n", api_backoff.outages, api_backoff.requeued,
+            api_backoff.failures ? " (still unreachable)" : "");
+    }
+    if (mirror_enabled) {
+        printf("state mirror: %ld hits (dropped), %ld misses (sent)\n", mirror_hits, mirror_misses);
+    }
+    if (led_writes) printf("leds: %ld changes written\n", led_writes);
+
+    if (entity_count > 0) {
+        printf("entity                              interval      rate/s   srtt ms      sent    failed\n");
+        for (i = 0; i < entity_count; i++) {
+            struct entity_state *entity = &entities[i];
+            if (entity->entity_id[0] == '\0' || (entity->sent == 0 && entity->failed == 0)) continue;
+            char rate[16] = "unthrottled";
+            if (entity->interval > 0) snprintf(rate, sizeof(rate), "%.1f", 1000000.0 / entity->interval);
+            printf("%-34s %7lldms %11s %9.1f %9ld %9ld\n", entity->entity_id, entity->interval / 1000,
+                rate, entity->srtt / 1000.0, entity->sent, entity->failed);
+        }
+    }
+    fflush(stdout);
+}
+
+
+void wake_main_loop(void) {
+    /* async signal safe, called from the midi thread and signal handlers */
+    uint64_t one = 1;
+    ssize_t written = write(wake_fd, &one, sizeof(one));
+    (void)written;
+}
+
+
+private void wait_for_work(long long timeout_micros) {
+
+    /*
+    block until the midi thread publishes a command, a signal arrives,
+    an http transfer has socket activity or timeout_micros passes
+    (-1 waits until one of the others). the waiting flag is
+    raised before the ring is re-checked so a command published in
+    between is never missed: either we see it here or the producer
+    sees the flag and writes to the eventfd
+    */
+
+    atomic_store(&main_loop_waiting, 1);
+
+    unsigned int tail = atomic_load_explicit(&command_ring.tail, memory_order_relaxed);
+    if (atomic_load(&command_ring.head) != tail || done || reload_requested || stats_requested ||
+            (ws.state == WS_RESOLVING && atomic_load(&ws.resolved))) {
+        atomic_store(&main_loop_waiting, 0);
+        return;
+    }
+
+    /* curl waits on its own sockets and timers plus our eventfd, websocket, sequencer and metrics listener */
+    struct curl_waitfd fds[4 + METRICS_MAX_CLIENTS];
+    int nfds = 1;
+    fds[0].fd = wake_fd;
+    fds[0].events = CURL_WAIT_POLLIN;
+    fds[0].revents = 0;
+
+    /* the websocket, while connecting until its deadline, and reconnecting when due */
+    long long now = monotonic_micros();
+    if (ws.fd != -1) {
+        fds[1].fd = ws.fd;
+        fds[1].events = CURL_WAIT_POLLIN | (ws.out_length > 0 || ws.state == WS_CONNECTING ? CURL_WAIT_POLLOUT : 0);
+        fds[1].revents = 0;
+        nfds++;
+        if (api_in_flight > 0 && (timeout_micros < 0 || timeout_micros > WS_REPLY_TIMEOUT)) timeout_micros = WS_REPLY_TIMEOUT;
+        if (ws.state != WS_READY && (timeout_micros < 0 || timeout_micros > ws.deadline - now)) timeout_micros = ws.deadline - now;
+    } else if ((mirror_enabled || use_websocket) && ws.state == WS_DISCONNECTED) {
+        long long due = ws.last_connect_attempt + WS_RECONNECT_INTERVAL - now;
+        if (timeout_micros < 0 || timeout_micros > due) timeout_micros = due;
+    }
+    if (timeout_micros < 0 && timeout_micros != -1) timeout_micros = 0;
+
+#ifdef M2HA_ALSA
+    if (use_alsa) {
+        fds[nfds].fd = seq_fd;
+        fds[nfds].events = CURL_WAIT_POLLIN;
+        fds[nfds].revents = 0;
+        nfds++;
+    }
+#endif
+
+    int i;
+    if (metrics_fd != -1) {
+        fds[nfds].fd = metrics_fd;
+        fds[nfds].events = CURL_WAIT_POLLIN;
+        fds[nfds].revents = 0;
+        nfds++;
+
+        for (i = 0; i < METRICS_MAX_CLIENTS; i++) {
+            struct metrics_client *client = &metrics_clients[i];
+            if (client->fd == -1) continue;
+            fds[nfds].fd = client->fd;
+            fds[nfds].events = client->response ? CURL_WAIT_POLLOUT : CURL_WAIT_POLLIN;
+            fds[nfds].revents = 0;
+            nfds++;
+        }
+    }
+
+    int timeout_ms = timeout_micros < 0 ? 60000 : (int)((timeout_micros + 999) / 1000);
+    curl_multi_wait(api_multi, fds, nfds, timeout_ms, NULL);
+    atomic_store(&main_loop_waiting, 0);
+
+    if (fds[0].revents & CURL_WAIT_POLLIN) {
+        uint64_t count;
+        ssize_t bytes = read(wake_fd, &count, sizeof(count));
+        (void)bytes;
+    }
+}
+
+
+void queue_api_call(char *entity_id, char *attribute, char *endpoint, char *body, struct timing *timing) {
+
+    /*
+    find the slot for this entity and attribute, or claim a new one,
+    and overwrite it with the latest value. the sequence number records
+    when the slot went dirty, so flushing sends slots in the order the
+    user started changing them (eg: a fader move followed by a mute) and
+    a slot rewritten all the time (a fader sweeping) can't keep jumping
+    ahead of one that has been waiting (the pot next to it)
+    */
+
+    if (strlen(entity_id) == 0) return;
+
+    struct queued_call *slot = NULL;
+    struct queued_call *free_slot = NULL;    /* left by reclaim_entities */
+    int i;
+    for (i = 0; i < call_queue_size; i++) {
+        if (strcmp(call_queue[i].entity_id, entity_id) == 0 && strcmp(call_queue[i].attribute, attribute) == 0) {
+            slot = &call_queue[i];
+            break;
+        }
+        if (free_slot == NULL && call_queue[i].entity_id[0] == '\0') free_slot = &call_queue[i];
+    }
+
+    if (slot == NULL) {
+        if (free_slot == NULL && call_queue_size == MAX_QUEUED_CALLS) {
+            fprintf(stderr, "call queue full, dropping update for %s\n", entity_id);
+            updates_dropped++;
+            return;
+        }
+        int entity = find_entity(entity_id);
+        if (entity < 0) {
+            fprintf(stderr, "too many entities, dropping update for %s\n", entity_id);
+            updates_dropped++;
+            return;
+        }
+        slot = free_slot ? free_slot : &call_queue[call_queue_size++];
+        slot->entity = entity;
+        slot->last_flushed = 0;
+        strcpy(slot->entity_id, entity_id);
+        strcpy(slot->attribute, attribute);
+    }
+
+    strcpy(slot->endpoint, endpoint);
+    strcpy(slot->body, body);
+    if (slot->sequence == 0) {
+        call_queue_dirty++;
+        slot->sequence = ++call_sequence;
+        slot->writes = 0;
+        slot->timing = *timing;
+    } else {
+        updates_coalesced++;
+    }
+    slot->writes++;
+}
+
+
+long long flush_api_calls(long long now) {
+
+    /*
+    start a request for every dirty slot whose entity is idle and past its
+    throttle interval, oldest write first. slots whose entity already has
+    a request in flight stay dirty and are sent once the reply arrives.
+    returns how long until the next slot becomes due, -1 if nothing is
+    waiting on time (either clean, or waiting on a reply)
+    */
+
+    struct queued_call *dirty[MAX_QUEUED_CALLS];
+    int count = 0;
+    int i, j;
+    long long timeout = -1;
+
+    if (call_queue_dirty == 0) return -1;
+
+    /* backing off, or waiting on the call probing whether home assistant is back */
+    if (api_backoff.failures > 0) {
+        if (now < api_backoff.retry_at) return api_backoff.retry_at - now;
+        if (api_in_flight > 0) return -1;
+    }
+
+    for (i = 0; i < call_queue_size; i++) {
+        if (call_queue[i].sequence == 0) continue;
+        for (j = count; j > 0 && dirty[j - 1]->sequence > call_queue[i].sequence; j--) dirty[j] = dirty[j - 1];
+        dirty[j] = &call_queue[i];
+        count++;
+    }
+
+    for (i = 0; i < count && api_in_flight < API_MAX_IN_FLIGHT; i++) {
+        struct queued_call *next = dirty[i];
+        if (next == NULL) continue;     /* merged into an earlier call */
+        struct entity_state *entity = &entities[next->entity];
+        if (entity->busy) continue;
+
+        long long due = entity->last_sent + entity->interval;
+        if (now < due) {
+            if (timeout < 0 || due - now < timeout) timeout = due - now;
+            continue;
+        }
+
+        if (mirror_drop(next)) continue;
+
+        /*
+        other entities that are due in this same window and waiting on the
+        same service with the same data (eg: a scene setting 8 bulbs to
+        the same brightness) ride along in this call as an entity_id array
+        */
+
+        struct queued_call *merged[API_MAX_MERGE];
+        int merged_count = 1;
+        merged[0] = next;
+
+        char *data = body_data(next->body);
+        size_t merged_length = strlen(next->body);
+
+        for (j = i + 1; j < count && merged_count < API_MAX_MERGE; j++) {
+            struct queued_call *other = dirty[j];
+            if (other == NULL || other->entity == next->entity) continue;
+
+            struct entity_state *other_entity = &entities[other->entity];
+            if (other_entity->busy || now < other_entity->last_sent + other_entity->interval) continue;
+            if (strcmp(other->endpoint, next->endpoint) != 0 || strcmp(body_data(other->body), data) != 0) continue;
+            if (mirror_drop(other)) {
+                dirty[j] = NULL;
+                continue;
+            }
+
+            /* leave room for the brackets and the transition */
+            size_t ids_length = body_data(other->body) - other->body - BODY_ENTITY_PREFIX;
+            if (merged_length + ids_length + 2 + 32 >= BODY_SIZE) break;
+            merged_length += ids_length + 2;
+
+            merged[merged_count++] = other;
+            dirty[j] = NULL;
+        }
+
+        char *body = next->body;
+        char combined[BODY_SIZE];
+        if (merged_count > 1) {
+            merge_bodies(combined, merged, merged_count);
+            body = combined;
+        }
+
+        /*
+        when smoothing, a brightness or kelvin value that is part of a sweep
+        (several values this window, or the previous one went out about a
+        window ago) is sent with a transition, so the light glides there
+        just as the next value is due. the window is the longest interval
+        of the merged entities, the next call can't go out sooner. while
+        the sweep goes on the measured gap since the last send predicts the
+        next one better, it is used when within one to two windows. a
+        single isolated change is still applied at once
+        */
+
+        char smoothed[BODY_SIZE];
+        long long window = 0;
+        for (j = 0; j < merged_count; j++) {
+            if (entities[merged[j]->entity].interval > window) window = entities[merged[j]->entity].interval;
+        }
+        long long gap = now - next->last_flushed;
+        if (smooth && strcmp(next->attribute, "state") != 0 && (next->writes > 1 || gap < 2 * window)) {
+            long long transition = gap >= window && gap < 2 * window ? gap : window;
+            snprintf(smoothed, sizeof(smoothed), "%.*s, \"transition\": %.3f}",
+                (int)strlen(body) - 1, body, transition / 1000000.0);
+            body = smoothed;
+        }
+
+        if (!api_send(merged, merged_count, next->endpoint, body, &next->timing)) {
+            /* nothing could be sent (eg: transport reconnecting), try again next interval */
+            if (api_in_flight == 0 && (timeout < 0 || entity->interval < timeout)) timeout = entity->interval;
+            break;
+        }
+
+        api_stats.merged += merged_count - 1;
+        for (j = 0; j < merged_count; j++) {
+            mirror_sent(merged[j]);
+            entities[merged[j]->entity].busy = true;
+            entities[merged[j]->entity].last_sent = now;
+            merged[j]->last_flushed = now;
+            merged[j]->sequence = 0;
+            call_queue_dirty--;
+        }
+
+        if (api_backoff.failures > 0) break;
+    }
+
+    return timeout;
+}
+
+
+private char *body_data(char *body) {
+
+    /*
+    the part of a body after its entity_id value, eg: `, "kelvin": 3000}`.
+    every body starts with {"entity_id": followed by a string or an array
+    */
+
+    char *value = body + BODY_ENTITY_PREFIX;
+    char *end = *value == '[' ? strchr(value, ']') : strchr(value + 1, '"');
+    return end ? end + 1 : value;
+}
+
+
+private void merge_bodies(char *out, struct queued_call **calls, int count) {
+
+    /* one body with the entity ids of every call, flush_api_calls checked it fits */
+
+    int length = sprintf(out, "{\"entity_id\": [");
+    int i;
+    for (i = 0; i < count; i++) {
+        char *ids = calls[i]->body + BODY_ENTITY_PREFIX;
+        char *data = body_data(calls[i]->body);
+        if (*ids == '[') {
+            ids++;
+            data--;
+        }
+        if (i > 0) length += sprintf(out + length, ", ");
+        memcpy(out + length, ids, data - ids);
+        length += data - ids;
+    }
+    sprintf(out + length, "]%s", body_data(calls[0]->body));
+}
+
+
+int find_entity(char *entity_id) {
+
+    /* index of the entity's throttle state, created on first use in a reclaimed entry or a new one */
+
+    int i, free_entry = -1;
+    for (i = 0; i < entity_count; i++) {
+        if (strcmp(entities[i].entity_id, entity_id) == 0) return i;
+        if (free_entry < 0 && entities[i].entity_id[0] == '\0') free_entry = i;
+    }
+    if (free_entry < 0) {
+        if (entity_count == MAX_ENTITIES) return -1;
+        free_entry = entity_count++;
+    }
+
+    struct entity_state *entity = &entities[free_entry];
+    memset(entity, 0, sizeof(*entity));
+    copy_field(entity->entity_id, entity_id, sizeof(entity->entity_id));
+    entity->interval = throttle;
+    entity->last_sent = -throttle;
+    mirror_invalidate(entity);
+    return free_entry;
+}
+
+
+private void reclaim_entities(struct mapping_table *table) {
+
+    /*
+    after a reload, forget the entities no mapping or group refers to any
+    more, with their call slots, so editing the mapping file again and
+    again never runs into MAX_ENTITIES. one with a request in flight or a
+    value waiting to be sent is left for the next reload. entries keep
+    their place, the indexes held by slots and requests stay valid, and
+    find_entity and queue_api_call reuse the empty ones
+    */
+
+    int i, j, k, reclaimed = 0;
+    for (i = 0; i < entity_count; i++) {
+        struct entity_state *entity = &entities[i];
+        if (entity->entity_id[0] == '\0' || entity->busy) continue;
+
+        boolean used = false;
+        for (j = 1; j < table->action_count && !used; j++) used = strcmp(table->actions[j].entity_id, entity->entity_id) == 0;
+        for (j = 0; j < table->group_count && !used; j++) {
+            for (k = 0; k < table->groups[j].count && !used; k++) used = strcmp(table->groups[j].entity_ids[k], entity->entity_id) == 0;
+        }
+        for (j = 0; j < call_queue_size && !used; j++) used = call_queue[j].entity == i && call_queue[j].sequence != 0;
+        if (used) continue;
+
+        for (j = 0; j < call_queue_size; j++) {
+            if (call_queue[j].entity != i) continue;
+            call_queue[j].entity = -1;
+            call_queue[j].entity_id[0] = '\0';
+        }
+        entity->entity_id[0] = '\0';
+        reclaimed++;
+    }
+
+    if (verbose && reclaimed) printf("%d entities no longer mapped, forgotten\n", reclaimed);
+}
+
+
+private void update_entity_throttle(struct entity_state *entity, boolean success, long long rtt) {
+
+    /* small decrease of the interval while the srtt is well below it, doubled when slow or failing */
+
+    entity->busy = false;
+
+    if (success) {
+        entity->sent++;
+        entity->srtt = entity->srtt ? (7 * entity->srtt + rtt) / 8 : rtt;
+    } else {
+        entity->failed++;
+    }
+
+    if (!success || entity->srtt * 2 > entity->interval) {
+        entity->interval *= 2;
+        if (entity->interval > THROTTLE_MAX) entity->interval = THROTTLE_MAX;
+    } else if (entity->srtt * 4 < entity->interval) {
+        long long step = entity->interval / THROTTLE_DECREASE;
+        entity->interval -= step > THROTTLE_MIN_STEP ? step : THROTTLE_MIN_STEP;
+    }
+    if (entity->interval < throttle) entity->interval = throttle;
+}
+
+
+char *channel_to_entity_id(int channel, boolean shift) {
+
+    if (shift) {
+        switch (channel) {
+            case 1: return "light.0xb0ce18140015fb0c";
+            case 2: return "light.0xb0ce1814001b1ee1";
+            default: return "";
+        }
+    }else {
+        switch (channel) {
+            case 1: return "light.0xb0ce1814001610b3";
+            case 2: return "light.0xb0ce181400163588";
+            case 3: return "light.0xb0ce1814001b08fb";
+            case 4: return "light.0xb0ce18140017bf5e";
+            case 5: return "light.0xb0ce1814001af553";
+            case 6: return "light.0xb0ce1814001af427";
+            case 7: return "light.0xb0ce1814001af6f2";
+            case 8: return "light.0xb0ce181400160048";
+            default: return "";
+        }
+    }
+    
+}
+
+
+private const struct controller_profile *find_profile(char *device_name) {
+
+    /* the profile whose name starts the device name, the nanoKONTROL2 for unknown devices */
+
+    int i;
+    for (i = 0; i < (int)(sizeof(profiles) / sizeof(profiles[0])); i++) {
+        if (strncmp(device_name, profiles[i].name, strlen(profiles[i].name)) == 0) return &profiles[i];
+    }
+    return &profiles[0];
+}
+
+
+/*
+mappings
+*/
+
+private char *action_names[] = { "none", "brightness", "kelvin", "turn_off", "toggle", "shift", "led" };
+
+
+private unsigned short lookup_action(struct mapping_table *table, int device, int layer, int kind, int channel, int control) {
+    return table->blocks[table->lookup[device][layer][kind][channel]][control];
+}
+
+
+private struct mapping_table *new_mapping_table(void) {
+
+    /* an empty table: block 0 and action 0 stand for unmapped */
+
+    struct mapping_table *table = calloc(1, sizeof(struct mapping_table));
+    if (table == NULL) return NULL;
+    table->blocks = calloc(1, sizeof(table->blocks[0]));
+    table->actions = calloc(32, sizeof(struct action));
+    if (table->blocks == NULL || table->actions == NULL) {
+        free_mapping_table(table);
+        return NULL;
+    }
+    table->block_count = 1;
+    table->action_count = 1;
+    table->action_capacity = 32;
+    return table;
+}
+
+
+private void free_mapping_table(struct mapping_table *table) {
+    if (table == NULL) return;
+    free(table->blocks);
+    free(table->actions);
+    free(table);
+}
+
+
+private int add_mapping(struct mapping_table *table, int device, int layer, int kind, int channel, int control, enum action_type type, char *entity_id) {
+
+    /*
+    append an action and point the lookup entry at it, device -1
+    maps the control on every device and layer -1 on every layer
+    */
+
+    if (table->action_count == MAX_ACTIONS) return -1;
+    if (table->action_count == table->action_capacity) {
+        int capacity = table->action_capacity * 2;
+        if (capacity > MAX_ACTIONS) capacity = MAX_ACTIONS;
+        struct action *grown = realloc(table->actions, capacity * sizeof(struct action));
+        if (grown == NULL) return -1;
+        table->actions = grown;
+        table->action_capacity = capacity;
+    }
+
+    struct action *action = &table->actions[table->action_count];
+    memset(action, 0, sizeof(*action));
+    action->type = type;
+    int i;
+    for (i = 0; i < MAX_DEVICES; i++) {
+        action->filter[i].raw = -1;
+        action->filter[i].direction = 0;
+        action->filter[i].output = -1;
+    }
+    copy_field(action->entity_id, entity_id, sizeof(action->entity_id));
+
+    /*
+    the json value of entity_id, and the service domain which is the
+    entity id up to the dot, eg: light, switch. a group whose members
+    are in different domains uses the generic homeassistant services
+    */
+
+    char ids[BODY_SIZE - 64];
+    char domain[32];
+    struct group *group = entity_id[0] == '@' ? find_group(table, entity_id + 1) : NULL;
+
+    if (group) {
+        int length = sprintf(ids, "[");
+        int i;
+        copy_field(domain, group->entity_ids[0], sizeof(domain));
+        char *dot = strchr(domain, '.');
+        if (dot) dot[1] = '\0';            /* compare members against "light." */
+        for (i = 0; i < group->count; i++) {
+            length += sprintf(ids + length, "%s\"%s\"", i ? ", " : "", group->entity_ids[i]);
+            if (strncmp(group->entity_ids[i], domain, strlen(domain)) != 0) strcpy(domain, "homeassistant.");
+        }
+        sprintf(ids + length, "]");
+    } else {
+        sprintf(ids, "\"%.49s\"", entity_id);
+        copy_field(domain, entity_id, sizeof(domain));
+    }
+
+    char *dot = strchr(domain, '.');
+    if (dot) *dot = '\0';
+
+    switch (type) {
+        case ACTION_BRIGHTNESS:
+        case ACTION_KELVIN:
+            strcpy(action->endpoint, "light/turn_on");
+            break;
+        case ACTION_TURN_OFF:
+            snprintf(action->endpoint, sizeof(action->endpoint), "%s/turn_off", domain);
+            break;
+        case ACTION_TOGGLE:
+            snprintf(action->endpoint, sizeof(action->endpoint), "%s/toggle", domain);
+            break;
+        default:
+            action->endpoint[0] = '\0';
+            break;
+    }
+
+    /*
+    preformat the json body once, handle_midi_event only appends the value.
+    load_mapping_file keeps groups small enough that the body fits
+    */
+
+    switch (type) {
+        case ACTION_BRIGHTNESS:
+            action->attribute = "brightness";
+            action->body_length = sprintf(action->body, "{\"entity_id\": %s, \"brightness_pct\": ", ids);
+            break;
+        case ACTION_KELVIN:
+            action->attribute = "kelvin";
+            action->body_length = sprintf(action->body, "{\"entity_id\": %s, \"kelvin\": ", ids);
+            break;
+        default:
+            action->attribute = "state";
+            action->body_length = sprintf(action->body, "{\"entity_id\": %s}", ids);
+            break;
+    }
+
+    if (kind == MAPPING_KIND_NRPN) {
+        if (table->nrpn_count == MAX_NRPN_MAPPINGS) return -1;
+        struct nrpn_mapping *mapping = &table->nrpn[table->nrpn_count++];
+        mapping->device = device;
+        mapping->layer = layer;
+        mapping->channel = channel;
+        mapping->parameter = control;
+        mapping->action = table->action_count;
+        table->action_count++;
+        return 0;
+    }
+
+    int d, l;
+    for (d = 0; d < MAX_DEVICES; d++) {
+        for (l = 0; l < MAPPING_LAYERS; l++) {
+            if ((device != -1 && device != d) || (layer != -1 && layer != l)) continue;
+
+            unsigned short *block = &table->lookup[d][l][kind][channel];
+            if (*block == 0) {
+                unsigned short (*grown)[128] = realloc(table->blocks, (table->block_count + 1) * sizeof(table->blocks[0]));
+                if (grown == NULL) return -1;
+                table->blocks = grown;
+                memset(table->blocks[table->block_count], 0, sizeof(table->blocks[0]));
+                *block = table->block_count++;
+            }
+            table->blocks[*block][control] = table->action_count;
+        }
+    }
+
+    table->action_count++;
+    return 0;
+}
+
+
+private struct group *find_group(struct mapping_table *table, char *name) {
+    int i;
+    for (i = 0; i < table->group_count; i++) {
+        if (strcmp(table->groups[i].name, name) == 0) return &table->groups[i];
+    }
+    return NULL;
+}
+
+
+private char *add_group(struct mapping_table *table, char *name, char **entity_ids, int count) {
+
+    /* define a group, returns an error message or NULL */
+
+    if (find_group(table, name)) return "group already defined";
+    if (table->group_count == MAX_GROUPS) return "too many groups";
+    if (count == 0) return "group needs at least one entity_id";
+    if (count > MAX_GROUP_MEMBERS) return "too many entities in group";
+
+    struct group *group = &table->groups[table->group_count];
+    size_t length = 0;
+    int i;
+    for (i = 0; i < count; i++) {
+        if (strchr(entity_ids[i], '.') == NULL) return "group members must be entity_ids like light.kitchen";
+        copy_field(group->entity_ids[i], entity_ids[i], sizeof(group->entity_ids[i]));
+        length += strlen(group->entity_ids[i]) + 4;
+    }
+    if (length + 64 > BODY_SIZE - 64) return "group entity_ids too long for one request";
+
+    copy_field(group->name, name, sizeof(group->name));
+    group->count = count;
+    table->group_count++;
+    return NULL;
+}
+
+
+struct mapping_table *load_default_mappings(void) {
+
+    /*
+    the built in layout: the strips of each device's profile mapped to
+    the lights returned by channel_to_entity_id. it is built for the
+    first midi channel and then answers on every channel, like the
+    controller does
+    */
+
+    struct mapping_table *table = new_mapping_table();
+    if (table == NULL) return NULL;
+
+    int channel, control, layer, device;
+
+    for (device = 0; device < device_count; device++) {
+        const struct controller_profile *profile = find_profile(devices[device].name);
+
+        for (control = 0; control < 128; control++) {
+            enum control_type type = profile->controls[control];
+            int strip = control - profile->first[type] + 1;
+            if (type == CONTROL_NONE) continue;
+
+            switch (type) {
+                case CONTROL_PLAY:
+                    add_mapping(table, device, -1, MAPPING_KIND_CC, 0, control, ACTION_TOGGLE, "switch.0x282c02bfffee12e7");
+                    continue;
+                case CONTROL_CYCLE:
+                    add_mapping(table, device, -1, MAPPING_KIND_CC, 0, control, ACTION_SHIFT, "");
+                    continue;
+                default:
+                    break;
+            }
+
+            for (layer = 0; layer < MAPPING_LAYERS; layer++) {
+                char *entity_id = channel_to_entity_id(strip, layer);
+                if (strlen(entity_id) == 0) continue;
+
+                switch (type) {
+                    case CONTROL_FADER:
+                        add_mapping(table, device, layer, MAPPING_KIND_CC, 0, control, ACTION_BRIGHTNESS, entity_id);
+                        break;
+                    case CONTROL_POT:
+                        add_mapping(table, device, layer, MAPPING_KIND_CC, 0, control, ACTION_KELVIN, entity_id);
+                        break;
+                    case CONTROL_MUTE:
+                        add_mapping(table, device, layer, MAPPING_KIND_CC, 0, control, ACTION_TURN_OFF, entity_id);
+                        break;
+                    case CONTROL_SOLO:
+                        add_mapping(table, device, layer, MAPPING_KIND_CC, 0, control, ACTION_LED, entity_id);
+                        break;
+                    default:
+                        break;
+                }
+            }
+        }
+
+        if (verbose) printf("%s: built in layout for the %s\n", devices[device].name, profile->name);
+    }
+
+    for (device = 0; device < MAX_DEVICES; device++) {
+        for (layer = 0; layer < MAPPING_LAYERS; layer++) {
+            for (channel = 1; channel < 16; channel++) {
+                table->lookup[device][layer][MAPPING_KIND_CC][channel] = table->lookup[device][layer][MAPPING_KIND_CC][0];
+            }
+        }
+    }
+
+    return table;
+}
+
+
+struct mapping_table *load_mapping_file(char *path) {
+
+    /*
+    read a mapping file, one mapping per line:
+
+        <cc|note> <midi channel 1-16> <control 0-127> <base|shift|any> <action> [entity_id|@group]
+
+    brightness and kelvin can also be mapped to a 14 bit control with
+    cc14 (its msb controller 0-31, the lsb is that + 32) or nrpn (its
+    parameter 0-16383) as the kind. or a group definition, which must come before the mappings using it:
+
+        group <name> <entity_id> [entity_id ...]
+
+    mappings apply to every device until a device line, then only to the
+    device given with that name (or position, 1 is the first -d) until
+    the next one. devices that were not given with -d are skipped:
+
+        device <name|number>
+
+    blank lines and lines starting with # are ignored.
+    returns NULL after printing the offending line on error
+    */
+
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "could not open mapping file '%s'\n", path);
+        return NULL;
+    }
+
+    struct mapping_table *table = new_mapping_table();
+    if (table == NULL) {
+        fclose(file);
+        return NULL;
+    }
+
+    char line[256];
+    int line_number = 0;
+    char *error = NULL;
+    int device = -1;                        /* every device, -2 for one that is not in use */
+
+    while (error == NULL && fgets(line, sizeof(line), file)) {
+        line_number++;
+
+        char kind_name[16], layer_name[16], action_name[16];
+        char entity_id[50] = "";
+        int channel, control;
+
+        char *start = line + strspn(line, " \t");
+        if (*start == '#' || *start == '\n' || *start == '\0') continue;
+
+        if (strncmp(start, "group ", 6) == 0 || strncmp(start, "group\t", 6) == 0) {
+            char *name = strtok(start + 6, " \t\n");
+            char *members[MAX_GROUP_MEMBERS + 1];
+            int count = 0;
+            char *member;
+            while (count <= MAX_GROUP_MEMBERS && (member = strtok(NULL, " \t\n"))) members[count++] = member;
+            error = name ? add_group(table, name, members, count) : "expected: group <name> <entity_id> [entity_id ...]";
+            continue;
+        }
+
+        if (strncmp(start, "device ", 7) == 0 || strncmp(start, "device\t", 7) == 0) {
+            char *name = start + 7 + strspn(start + 7, " \t");
+            name[strcspn(name, "\r\n")] = '\0';
+            if (*name == '\0') { error = "expected: device <name|number>"; break; }
+
+            int number = atoi(name);
+            for (device = 0; device < device_count; device++) {
+                if (number == device + 1 || strcmp(name, devices[device].name) == 0) break;
+            }
+            if (device == device_count) device = -2;
+            continue;
+        }
+
+        int fields = sscanf(start, "%15s %d %d %15s %15s %49s", kind_name, &channel, &control, layer_name, action_name, entity_id);
+        if (fields < 5) {
+            error = "expected: <cc|note|cc14|nrpn> <channel> <control> <base|shift|any> <action> [entity_id]";
+            break;
+        }
+
+        int kind;
+        if (strcmp(kind_name, "cc") == 0) kind = MAPPING_KIND_CC;
+        else if (strcmp(kind_name, "note") == 0) kind = MAPPING_KIND_NOTE;
+        else if (strcmp(kind_name, "cc14") == 0) kind = MAPPING_KIND_CC14;
+        else if (strcmp(kind_name, "nrpn") == 0) kind = MAPPING_KIND_NRPN;
+        else { error = "message kind must be cc, note, cc14 or nrpn"; break; }
+
+        if (channel < 1 || channel > 16) { error = "midi channel must be 1-16"; break; }
+        if (kind == MAPPING_KIND_CC14 && (control < 0 || control > 31)) { error = "cc14 control must be its msb controller 0-31"; break; }
+        if (kind == MAPPING_KIND_NRPN && (control < 0 || control > 16382)) { error = "nrpn parameter must be 0-16382"; break; }
+        if (kind < MAPPING_KIND_CC14 && (control < 0 || control > 127)) { error = "control must be 0-127"; break; }
+
+        int layer;
+        if (strcmp(layer_name, "base") == 0) layer = 0;
+        else if (strcmp(layer_name, "shift") == 0) layer = 1;
+        else if (strcmp(layer_name, "any") == 0) layer = -1;
+        else { error = "layer must be base, shift or any"; break; }
+
+        int type;
+        for (type = ACTION_BRIGHTNESS; type <= ACTION_LED; type++) {
+            if (strcmp(action_name, action_names[type]) == 0) break;
+        }
+        if (type > ACTION_LED) { error = "action must be brightness, kelvin, turn_off, toggle, shift or led"; break; }
+        if (kind >= MAPPING_KIND_CC14 && type != ACTION_BRIGHTNESS && type != ACTION_KELVIN) { error = "cc14 and nrpn only take brightness or kelvin"; break; }
+        if (entity_id[0] == '@') {
+            if (find_group(table, entity_id + 1) == NULL) { error = "unknown group, define it first with: group <name> <entity_id> ..."; break; }
+        } else if (type != ACTION_SHIFT && strchr(entity_id, '.') == NULL) {
+            error = "action needs an entity_id like light.kitchen or @group";
+            break;
+        }
+
+        if (device == -2) continue;
+        if (add_mapping(table, device, layer, kind, channel - 1, control, type, entity_id) != 0) error = "too many mappings";
+    }
+
+    fclose(file);
+
+    if (error) {
+        fprintf(stderr, "%s:%d: %s\n", path, line_number, error);
+        free_mapping_table(table);
+        return NULL;
+    }
+
+    return table;
+}
+
+
+void reload_mappings(void) {
+
+    /*
+    build the new table off to the side, swap it in, then wait out the
+    grace period before freeing the old one. a file with errors leaves
+    the current mappings in place
+    */
+
+    long long started = monotonic_micros();
+    unsigned long events_before = atomic_load(&midi_events);
+
+    struct mapping_table *table = mapping_file ? load_mapping_file(mapping_file) : load_default_mappings();
+    if (table == NULL) {
+        fprintf(stderr, "reload failed, keeping the current mappings\n");
+        return;
+    }
+
+    long long loaded = monotonic_micros();
+    struct mapping_table *old = atomic_exchange(&mappings, table);
+    if (!wait_for_midi_thread()) {
+        fprintf(stderr, "midi thread did not release the old mappings, leaking them\n");
+        old = NULL;
+    }
+    free_mapping_table(old);
+    reclaim_entities(table);
+
+    if (mirror_enabled) {
+        mirror_track(table);
+        if (ws.state == WS_READY) mirror_subscribe();
+    }
+    atomic_store(&leds_dirty, 1);
+
+    long long finished = monotonic_micros();
+    printf("mappings reloaded: %d actions in %lldus (load %lldus, grace period %lldus), %lu midi events handled during reload\n",
+        table->action_count - 1, finished - started, loaded - started, finished - loaded,
+        atomic_load(&midi_events) - events_before);
+}
+
+
+int check_mappings(struct mapping_table *table, char *states_path) {
+
+    /*
+    verify every mapped entity exists in a dump of /api/states,
+    returns the number of unknown entities
+    */
+
+    FILE *file = fopen(states_path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "could not open states file '%s'\n", states_path);
+        return 1;
+    }
+
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char *states = malloc(size + 1);
+    size = fread(states, 1, size, file);
+    states[size] = '\0';
+    fclose(file);
+
+    int missing = 0;
+    int i, j;
+    for (i = 1; i < table->action_count; i++) {
+        char *entity_id = table->actions[i].entity_id;
+        if (strlen(entity_id) == 0 || entity_id[0] == '@') continue;
+
+        /* report each entity once */
+        for (j = 1; j < i; j++) {
+            if (strcmp(table->actions[j].entity_id, entity_id) == 0) break;
+        }
+        if (j < i) continue;
+
+        char compact[80];
+        char spaced[80];
+        snprintf(compact, sizeof(compact), "\"entity_id\":\"%s\"", entity_id);
+        snprintf(spaced, sizeof(spaced), "\"entity_id\": \"%s\"", entity_id);
+
+        if (strstr(states, compact) == NULL && strstr(states, spaced) == NULL) {
+            printf("unknown entity: %s (%s)\n", entity_id, action_names[table->actions[i].type]);
+            missing++;
+        }
+    }
+
+    for (i = 0; i < table->group_count; i++) {
+        struct group *group = &table->groups[i];
+        for (j = 0; j < group->count; j++) {
+            char compact[80];
+            char spaced[80];
+            snprintf(compact, sizeof(compact), "\"entity_id\":\"%s\"", group->entity_ids[j]);
+            snprintf(spaced, sizeof(spaced), "\"entity_id\": \"%s\"", group->entity_ids[j]);
+
+            if (strstr(states, compact) == NULL && strstr(states, spaced) == NULL) {
+                printf("unknown entity: %s (group %s)\n", group->entity_ids[j], group->name);
+                missing++;
+            }
+        }
+    }
+
+    free(states);
+    printf("%d mappings checked, %d unknown entities\n", table->action_count - 1, missing);
+    return missing;
+}
+
+
+size_t write_null(void *buffer, size_t size, size_t nmemb, void *userp) {
+    return size * nmemb;
+}
+
+
+int api_init(void) {
+
+    /*
+    create the multi handle and the pool of easy handles. every easy handle
+    is duplicated from one template so they share the headers and options.
+    dns results are cached for the life of the multi handle and tcp
+    keep-alive probes hold the idle connections to home assistant open
+    */
+
+    char *token = getenv("TOKEN");
+    if (token == NULL) {
+        fprintf(stderr, "TOKEN environment variable not set\n");
+        return 1;
+    }
+
+    /* seeds the websocket masks and the retry jitter */
+    srand(getpid() ^ monotonic_micros());
+
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    api_multi = curl_multi_init();
+    CURL *template = curl_easy_init();
+    if (api_multi == NULL || template == NULL) {
+        fprintf(stderr, "Failed to initialize curl\n");
+        return 1;
+    }
+
+    char *auth_header = malloc(strlen("Authorization: Bearer ") + strlen(token) + 1);
+    sprintf(auth_header, "Authorization: Bearer %s", token);
+    api_headers = curl_slist_append(api_headers, auth_header);
+    free(auth_header);
+    api_headers = curl_slist_append(api_headers, "Content-Type: application/json");
+
+    /* disable printing */
+    curl_easy_setopt(template, CURLOPT_WRITEFUNCTION, write_null);
+
+    curl_easy_setopt(template, CURLOPT_HTTPHEADER, api_headers);
+    curl_easy_setopt(template, CURLOPT_POST, 1L);
+
+    /* connection reuse */
+    curl_easy_setopt(template, CURLOPT_DNS_CACHE_TIMEOUT, -1L);
+    curl_easy_setopt(template, CURLOPT_TCP_KEEPALIVE, 1L);
+    curl_easy_setopt(template, CURLOPT_TCP_KEEPIDLE, 30L);
+    curl_easy_setopt(template, CURLOPT_TCP_KEEPINTVL, 10L);
+    curl_easy_setopt(template, CURLOPT_CONNECTTIMEOUT_MS, 2000L);
+    curl_easy_setopt(template, CURLOPT_TIMEOUT_MS, 5000L);
+
+    /* every handle keeps its own url, prefilled with the part that never changes */
+    char prefix[200];
+    api_url_prefix_length = snprintf(prefix, sizeof(prefix), "%s/api/services/", api_url);
+    if (api_url_prefix_length + sizeof(api_requests[0].endpoint) > sizeof(api_requests[0].url)) {
+        fprintf(stderr, "api url too long: %s\n", api_url);
+        return 1;
+    }
+
+    int i;
+    for (i = 0; i < API_MAX_IN_FLIGHT; i++) {
+        api_requests[i].easy = curl_easy_duphandle(template);
+        curl_easy_setopt(api_requests[i].easy, CURLOPT_PRIVATE, &api_requests[i]);
+        strcpy(api_requests[i].url, prefix);
+    }
+    curl_easy_cleanup(template);
+
+    curl_multi_setopt(api_multi, CURLMOPT_MAXCONNECTS, (long)API_MAX_IN_FLIGHT);
+    curl_multi_setopt(api_multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long)API_MAX_IN_FLIGHT);
+
+    return 0;
+}
+
+
+private void api_start(struct api_request *request) {
+
+    /*
+    only the service part of the url changes between calls, and curl
+    copies the url on every setopt, so it is only set when that changed
+    */
+
+    char *service = request->url + api_url_prefix_length;
+    if (strcmp(service, request->endpoint) != 0) {
+        strcpy(service, request->endpoint);
+        curl_easy_setopt(request->easy, CURLOPT_URL, request->url);
+    }
+    curl_easy_setopt(request->easy, CURLOPT_POSTFIELDS, request->body);
+
+    request->attempts++;
+    curl_multi_add_handle(api_multi, request->easy);
+}
+
+
+boolean api_send(struct queued_call **calls, int call_count, char *endpoint, char *body, struct timing *timing) {
+
+    /*
+    start a request on a free handle, returns false when
+    every handle in the pool already has a request in flight
+    */
+
+    struct api_request *request = NULL;
+    int i;
+    for (i = 0; i < API_MAX_IN_FLIGHT; i++) {
+        if (!api_requests[i].busy) {
+            request = &api_requests[i];
+            break;
+        }
+    }
+    if (request == NULL) return false;
+
+    request->attempts = 0;
+    request->status = 0;
+    request->started = monotonic_micros();
+    request->timing = *timing;
+    request->timing.sent = request->started;
+    for (i = 0; i < call_count; i++) {
+        request->entity_indexes[i] = calls[i]->entity;
+        request->call_indexes[i] = calls[i] - call_queue;
+        request->sequences[i] = calls[i]->sequence;
+    }
+    request->entity_count = call_count;
+    if (call_count > 1) {
+        snprintf(request->entity_id, sizeof(request->entity_id), "%.40s +%d", entities[calls[0]->entity].entity_id, call_count - 1);
+    } else {
+        copy_field(request->entity_id, entities[calls[0]->entity].entity_id, sizeof(request->entity_id));
+    }
+    copy_field(request->endpoint, endpoint, sizeof(request->endpoint));
+    copy_field(request->body, body, sizeof(request->body));
+
+    if (use_websocket) {
+        if (!ws_send(request)) return false;
+    } else {
+        api_start(request);
+    }
+
+    request->busy = true;
+    api_in_flight++;
+    return true;
+}
+
+
+private void api_complete(struct api_request *request, CURLcode response) {
+
+    curl_multi_remove_handle(api_multi, request->easy);
+
+    /*
+    if a reused connection went stale (eg: home assistant restarted)
+    retry once on a fresh connection with a fresh dns lookup
+    */
+
+    if (response != CURLE_OK && request->attempts == 1) {
+        curl_easy_setopt(request->easy, CURLOPT_FRESH_CONNECT, 1L);
+        curl_easy_setopt(request->easy, CURLOPT_DNS_CACHE_TIMEOUT, 0L);
+        api_start(request);
+        return;
+    }
+
+    if (request->attempts > 1) {
+        curl_easy_setopt(request->easy, CURLOPT_FRESH_CONNECT, 0L);
+        curl_easy_setopt(request->easy, CURLOPT_DNS_CACHE_TIMEOUT, -1L);
+    }
+
+    long connects = 0;
+    curl_off_t connect_micros = 0;
+    curl_off_t total_micros = 0;
+    curl_easy_getinfo(request->easy, CURLINFO_NUM_CONNECTS, &connects);
+    curl_easy_getinfo(request->easy, CURLINFO_CONNECT_TIME_T, &connect_micros);
+    curl_easy_getinfo(request->easy, CURLINFO_TOTAL_TIME_T, &total_micros);
+    api_stats.connects += connects;
+
+    /* a 5xx is home assistant (or a proxy in front of it) not being up yet, a 4xx won't get better */
+    long status = 0;
+    curl_easy_getinfo(request->easy, CURLINFO_RESPONSE_CODE, &status);
+    request->status = status;
+    if (response != CURLE_OK) {
+        api_finish(request, false, true, curl_easy_strerror(response), connect_micros, total_micros);
+    } else if (status >= 400) {
+        char error[32];
+        snprintf(error, sizeof(error), "http status %ld", status);
+        api_finish(request, false, status >= 500, error, connect_micros, total_micros);
+    } else {
+        api_finish(request, true, false, NULL, connect_micros, total_micros);
+    }
+}
+
+
+private void api_finish(struct api_request *request, boolean success, boolean retry, const char *error, curl_off_t connect_micros, curl_off_t total_micros) {
+
+    /*
+    release the request back to the pool and record its timing,
+    shared by the rest and websocket transports. retry marks a failure
+    of home assistant being unreachable rather than of the call
+    */
+
+    long long now = monotonic_micros();
+
+    request->busy = false;
+    api_in_flight--;
+    api_stats.requests++;
+    api_stats.statuses[request->status >= 100 && request->status < 600 ? request->status / 100 : 0]++;
+    int i;
+    for (i = 0; i < request->entity_count; i++) {
+        struct entity_state *entity = &entities[request->entity_indexes[i]];
+        if (retry) {
+            /* not the entity being slow, the backoff holds every entity */
+            entity->busy = false;
+            entity->failed++;
+        } else {
+            update_entity_throttle(entity, success, now - request->timing.sent);
+        }
+        if (!success) mirror_invalidate(entity);
+    }
+
+    /* check for errors */
+    if (!success && retry) {
+        api_stats.failures++;
+        for (i = 0; i < request->entity_count; i++) {
+            struct queued_call *call = &call_queue[request->call_indexes[i]];
+            if (call->sequence != 0 || strstr(call->endpoint, "/toggle")) continue;
+            call->sequence = request->sequences[i];
+            call_queue_dirty++;
+            api_backoff.requeued++;
+        }
+        if (verbose) printf("%s %s failed: %s, queued again\n", request->endpoint, request->entity_id, error);
+        api_unreachable(now, error);
+        return;
+    }
+    if (!success) {
+        api_stats.failures++;
+        fprintf(stderr, "%s %s failed: %s\n", request->endpoint, request->entity_id, error);
+        return;
+    }
+
+    if (api_backoff.failures > 0) {
+        printf("home assistant is back after %.1fs, sending %d queued calls\n",
+            (now - api_backoff.since) / 1000000.0, call_queue_dirty);
+        api_backoff.failures = 0;
+        api_backoff.retry_at = 0;
+    }
+
+    record_latency(STAGE_QUEUE, request->timing.sent - request->timing.dequeued);
+    record_latency(STAGE_HTTP, now - request->timing.sent);
+    record_latency(STAGE_TOTAL, now - request->timing.arrived);
+
+    api_stats.connect_micros += connect_micros;
+    api_stats.total_micros += total_micros;
+
+    if (verbose) {
+        printf("%s %s: connect %ldus total %ldus%s, %dms since midi input\n", request->endpoint, request->entity_id,
+            (long)connect_micros, (long)total_micros, connect_micros ? "" : " (reused)", Pt_Time() - request->timing.timestamp);
+    }
+}
+
+
+private void api_unreachable(long long now, const char *error) {
+
+    /*
+    hold off every call for an exponentially growing backoff. it is
+    jittered between half and all of it so that several instances don't
+    hit a restarting home assistant in lockstep. calls that were already
+    in flight when it went away fail together, they count once
+    */
+
+    if (now < api_backoff.retry_at) return;
+
+    long long backoff = RETRY_BACKOFF_MIN;
+    int i;
+    for (i = 0; i < api_backoff.failures && backoff < RETRY_BACKOFF_MAX; i++) backoff *= 2;
+    if (backoff > RETRY_BACKOFF_MAX) backoff = RETRY_BACKOFF_MAX;
+    backoff = backoff / 2 + rand() % (backoff / 2 + 1);
+
+    if (api_backoff.failures == 0) {
+        fprintf(stderr, "home assistant unreachable (%s), holding calls until it is back\n", error);
+        api_backoff.since = now;
+        api_backoff.outages++;
+    }
+    api_backoff.failures++;
+    api_backoff.retry_at = now + backoff;
+    if (verbose) printf("retrying in %lldms\n", backoff / 1000);
+}
+
+
+int api_poll(void) {
+
+    /*
+    let curl make progress on every transfer and retire the finished ones,
+    returns the number of requests that completed
+    */
+
+    int running;
+    int completed = 0;
+    int queued;
+    CURLMsg *message;
+
+    int in_flight = api_in_flight;
+
+    ws_progress();
+    if ((mirror_enabled || use_websocket) && ws.state == WS_DISCONNECTED) ws_open();
+
+    if (use_websocket) {
+        /* a reply that never comes must not block its entity forever */
+        long long now = monotonic_micros();
+        int i;
+        for (i = 0; i < API_MAX_IN_FLIGHT; i++) {
+            if (api_requests[i].busy && now - api_requests[i].started > WS_REPLY_TIMEOUT) {
+                api_finish(&api_requests[i], false, true, "no reply", 0, 0);
+            }
+        }
+    }
+
+    /* with the websocket transport only the mirror seed runs on curl */
+    curl_multi_perform(api_multi, &running);
+
+    while ((message = curl_multi_info_read(api_multi, &queued))) {
+        if (message->msg != CURLMSG_DONE) continue;
+        if (message->easy_handle == mirror_seed_easy) {
+            mirror_seeded(message->data.result);
+            continue;
+        }
+
+        struct api_request *request;
+        curl_easy_getinfo(message->easy_handle, CURLINFO_PRIVATE, (char **)&request);
+        api_complete(request, message->data.result);
+        completed++;
+    }
+
+    return use_websocket ? in_flight - api_in_flight : completed;
+}
+
+
+void api_cleanup(void) {
+
+    if (api_stats.requests > 0) {
+        printf("api calls: %ld sent, %ld failed, %ld new connections, avg connect %ldus, avg total %ldus\n",
+            api_stats.requests, api_stats.failures, api_stats.connects,
+            (long)(api_stats.connect_micros / api_stats.requests),
+            (long)(api_stats.total_micros / api_stats.requests));
+    }
+
+    if (ws.fd != -1) close(ws.fd);
+    mirror_seed_stop();
+
+    /* always cleanup */
+    int i;
+    for (i = 0; i < API_MAX_IN_FLIGHT; i++) {
+        if (api_requests[i].busy && !use_websocket) curl_multi_remove_handle(api_multi, api_requests[i].easy);
+        curl_easy_cleanup(api_requests[i].easy);
+    }
+    curl_multi_cleanup(api_multi);
+    curl_slist_free_all(api_headers);
+    curl_global_cleanup();
+}
+
+
+/*
+websocket transport
+*/
+
+private void base64_encode(const unsigned char *in, int length, char *out) {
+    static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    int i;
+    for (i = 0; i < length; i += 3) {
+        int value = in[i] << 16 | (i + 1 < length ? in[i + 1] << 8 : 0) | (i + 2 < length ? in[i + 2] : 0);
+        *out++ = table[(value >> 18) & 0x3f];
+        *out++ = table[(value >> 12) & 0x3f];
+        *out++ = i + 1 < length ? table[(value >> 6) & 0x3f] : '=';
+        *out++ = i + 2 < length ? table[value & 0x3f] : '=';
+    }
+    *out = '\0';
+}
+
+
+private long json_find_long(char *json, char *key, long fallback) {
+
+    /*
+    minimal lookup of a numeric field in a home assistant message,
+    good enough for the top level "id" which always comes first
+    */
+
+    char quoted[40];
+    snprintf(quoted, sizeof(quoted), "\"%s\"", key);
+    char *found = strstr(json, quoted);
+    if (found == NULL) return fallback;
+    found += strlen(quoted);
+    while (*found == ' ' || *found == ':') found++;
+    if (!isdigit((unsigned char)*found) && *found != '-') return fallback;
+    return strtol(found, NULL, 10);
+}
+
+
+private boolean json_has(char *json, char *key, char *value) {
+
+    /* true when json contains "key": value, with or without a space */
+
+    char compact[80];
+    char spaced[80];
+    snprintf(compact, sizeof(compact), "\"%s\":%s", key, value);
+    snprintf(spaced, sizeof(spaced), "\"%s\": %s", key, value);
+    return strstr(json, compact) != NULL || strstr(json, spaced) != NULL;
+}
+
+
+private int ws_flush(void) {
+
+    while (ws.out_length > 0) {
+        ssize_t written = send(ws.fd, ws.out, ws.out_length, MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        memmove(ws.out, ws.out + written, ws.out_length - written);
+        ws.out_length -= written;
+    }
+    return 0;
+}
+
+
+private int ws_send_frame(int opcode, char *payload, size_t length) {
+
+    /*
+    queue one masked client frame, the mask only has to be unpredictable
+    to intermediaries, not secret, so rand() is good enough
+    */
+
+    if (ws.out_length + length + 14 > sizeof(ws.out)) return -1;
+
+    unsigned char *frame = (unsigned char *)ws.out + ws.out_length;
+    size_t header = 2;
+
+    frame[0] = 0x80 | opcode;
+    if (length < 126) {
+        frame[1] = 0x80 | length;
+    } else if (length < 65536) {
+        frame[1] = 0x80 | 126;
+        frame[2] = length >> 8;
+        frame[3] = length & 0xff;
+        header = 4;
+    } else {
+        return -1;
+    }
+
+    unsigned char *mask = frame + header;
+    int i;
+    for (i = 0; i < 4; i++) mask[i] = rand() & 0xff;
+
+    unsigned char *data = mask + 4;
+    size_t n;
+    for (n = 0; n < length; n++) data[n] = payload[n] ^ mask[n & 3];
+
+    ws.out_length += header + 4 + length;
+    return ws_flush();
+}
+
+
+private void ws_close(char *reason) {
+
+    /*
+    drop the connection and fail every request still waiting on a reply,
+    api_poll reconnects after WS_RECONNECT_INTERVAL
+    */
+
+    if (ws.fd == -1) return;
+
+    fprintf(stderr, "websocket closed: %s\n", reason);
+    close(ws.fd);
+    ws.fd = -1;
+    ws.state = WS_DISCONNECTED;
+    ws.subscribed = false;
+    ws.in_length = 0;
+    ws.out_length = 0;
+    ws.message_length = 0;
+
+    int i;
+    if (use_websocket) {
+        for (i = 0; i < API_MAX_IN_FLIGHT; i++) {
+            if (api_requests[i].busy) api_finish(&api_requests[i], false, true, reason, 0, 0);
+        }
+    }
+
+    /* without the subscription the mirror goes stale, and so would a seed still coming in */
+    mirror_seed_stop();
+    for (i = 0; i < entity_count; i++) mirror_invalidate(&entities[i]);
+}
+
+
+private void *ws_resolve(void *unused) {
+
+    /* on its own thread, ws_progress picks the result up */
+
+    struct addrinfo hints;
+    struct addrinfo *addresses;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    ws.resolve_error = getaddrinfo(ws.host, ws.port, &hints, &addresses);
+    if (ws.resolve_error == 0) {
+        memcpy(&ws.address, addresses->ai_addr, addresses->ai_addrlen);
+        ws.address_length = addresses->ai_addrlen;
+        freeaddrinfo(addresses);
+    }
+
+    atomic_store(&ws.resolved, 1);
+    if (atomic_exchange(&main_loop_waiting, 0)) wake_main_loop();
+    return NULL;
+}
+
+
+private int ws_connect(void) {
+
+    /* start a nonblocking connect to the resolved address */
+
+    int fd = socket(ws.address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        fprintf(stderr, "websocket: could not create socket: %s\n", strerror(errno));
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+
+    if (connect(fd, (struct sockaddr *)&ws.address, ws.address_length) != 0 && errno != EINPROGRESS) {
+        fprintf(stderr, "websocket: could not connect to %s:%s: %s\n", ws.host, ws.port, strerror(errno));
+        close(fd);
+        ws.address_length = 0;          /* resolve again next time */
+        return -1;
+    }
+
+    ws.fd = fd;
+    ws.state = WS_CONNECTING;
+    ws.deadline = monotonic_micros() + WS_CONNECT_TIMEOUT;
+    return 0;
+}
+
+
+private void ws_upgrade(void) {
+
+    /*
+    connected, queue the http upgrade request. the Sec-WebSocket-Accept
+    hash of the reply is not verified, a 101 from the configured server
+    is trusted
+    */
+
+    unsigned char nonce[16];
+    char key[32];
+    int i;
+    for (i = 0; i < 16; i++) nonce[i] = rand() & 0xff;
+    base64_encode(nonce, 16, key);
+
+    ws.out_length = snprintf(ws.out, sizeof(ws.out),
+        "GET /api/websocket HTTP/1.1\r\n"
+        "Host: %s:%s\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Key: %s\r\n"
+        "Sec-WebSocket-Version: 13\r\n\r\n", ws.host, ws.port, key);
+    ws.state = WS_UPGRADING;
+}
+
+
+private void ws_progress(void) {
+
+    /* move the connection along and handle whatever arrived, see ws_open */
+
+    if (ws.state == WS_RESOLVING) {
+        if (!atomic_load(&ws.resolved)) return;
+        ws.state = WS_DISCONNECTED;
+        if (ws.resolve_error != 0) {
+            fprintf(stderr, "websocket: could not resolve %s: %s\n", ws.host, gai_strerror(ws.resolve_error));
+            ws.address_length = 0;
+            return;
+        }
+        if (ws_connect() != 0) return;
+    }
+
+    if (ws.fd == -1) return;
+
+    if (ws.state != WS_READY && monotonic_micros() > ws.deadline) {
+        ws.address_length = 0;
+        ws_close("connect timed out");
+        return;
+    }
+
+    if (ws.state == WS_CONNECTING) {
+        struct pollfd ready = { .fd = ws.fd, .events = POLLOUT };
+        if (poll(&ready, 1, 0) != 1) return;
+
+        int error = 0;
+        socklen_t length = sizeof(error);
+        getsockopt(ws.fd, SOL_SOCKET, SO_ERROR, &error, &length);
+        if (error != 0) {
+            ws.address_length = 0;
+            ws_close(strerror(error));
+            return;
+        }
+        ws_upgrade();
+    }
+
+    ws_read();
+    if (ws.fd != -1 && ws_flush() != 0) ws_close("send failed");
+}
+
+
+private void ws_handle_message(char *message) {
+
+    if (json_has(message, "type", "\"auth_required\"")) {
+        char auth[600];
+        int length = snprintf(auth, sizeof(auth), "{\"type\": \"auth\", \"access_token\": \"%s\"}", getenv("TOKEN"));
+        ws_send_frame(WS_OPCODE_TEXT, auth, length);
+
+    } else if (json_has(message, "type", "\"auth_ok\"")) {
+        ws.state = WS_READY;
+        if (verbose) printf("websocket authenticated\n");
+        if (mirror_enabled) mirror_subscribe();
+
+    } else if (json_has(message, "type", "\"event\"")) {
+        mirror_handle_event(message);
+
+    } else if (json_has(message, "type", "\"auth_invalid\"")) {
+        fprintf(stderr, "websocket: invalid access token\n");
+        ws_close("auth_invalid");
+        done = 1;
+
+    } else if (json_has(message, "type", "\"result\"")) {
+
+        /* match the reply to its request by id */
+        long id = json_find_long(message, "id", -1);
+        int i;
+        if (id == ws.subscribe_id) {
+            ws.subscribed = json_has(message, "success", "true");
+            if (!ws.subscribed) fprintf(stderr, "state mirror: subscription refused, calls are not checked against it\n");
+            return;
+        }
+
+        for (i = 0; i < API_MAX_IN_FLIGHT; i++) {
+            struct api_request *request = &api_requests[i];
+            if (!request->busy || request->ws_id != id) continue;
+
+            boolean success = json_has(message, "success", "true");
+            request->status = success ? 200 : 400;
+            api_finish(request, success, false, success ? NULL : "service call failed", 0, monotonic_micros() - request->started);
+            break;
+        }
+    }
+}
+
+
+private void ws_read(void) {
+
+    /*
+    read whatever the socket has and dispatch every complete message,
+    reassembling fragmented messages and answering pings
+    */
+
+    while (ws.fd != -1) {
+        ssize_t received = recv(ws.fd, ws.in + ws.in_length, sizeof(ws.in) - ws.in_length, 0);
+        if (received == 0) {
+            ws_close("connection closed by server");
+            return;
+        }
+        if (received < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) ws_close(strerror(errno));
+            break;
+        }
+        ws.in_length += received;
+
+        if (ws.state == WS_UPGRADING) {
+            /* the response headers, frames may follow them in the same read */
+            char *end = memmem(ws.in, ws.in_length, "\r\n\r\n", 4);
+            if (end == NULL) {
+                if (ws.in_length == sizeof(ws.in)) ws_close("upgrade response too large");
+                continue;
+            }
+            if (strncmp(ws.in, "HTTP/1.1 101", 12) != 0) {
+                fprintf(stderr, "websocket: upgrade refused by %s:%s\n", ws.host, ws.port);
+                ws_close("upgrade refused");
+                return;
+            }
+            size_t headers = end + 4 - ws.in;
+            memmove(ws.in, ws.in + headers, ws.in_length - headers);
+            ws.in_length -= headers;
+            ws.state = WS_AUTHENTICATING;
+            api_stats.connects++;
+        }
+
+        while (ws.in_length >= 2) {
+            unsigned char *frame = (unsigned char *)ws.in;
+            boolean fin = frame[0] & 0x80;
+            int opcode = frame[0] & 0x0f;
+            size_t length = frame[1] & 0x7f;
+            size_t header = 2;
+
+            if (length == 126) {
+                if (ws.in_length < 4) break;
+                length = frame[2] << 8 | frame[3];
+                header = 4;
+            } else if (length == 127) {
+                ws_close("frame too large");
+                return;
+            }
+            if (ws.in_length < header + length) break;
+
+            char *payload = ws.in + header;
+
+            if (opcode == WS_OPCODE_PING) {
+                ws_send_frame(WS_OPCODE_PONG, payload, length);
+            } else if (opcode == WS_OPCODE_CLOSE) {
+                ws_close("close frame received");
+                return;
+            } else if (opcode == WS_OPCODE_TEXT || opcode == WS_OPCODE_CONTINUATION) {
+                if (ws.message_length + length >= sizeof(ws.message)) {
+                    /* oversized messages (eg: large state dumps) are skipped */
+                    ws.message_length = sizeof(ws.message);
+                } else {
+                    memcpy(ws.message + ws.message_length, payload, length);
+                    ws.message_length += length;
+                }
+                if (fin) {
+                    if (ws.message_length < sizeof(ws.message)) {
+                        ws.message[ws.message_length] = '\0';
+                        ws_handle_message(ws.message);
+                    }
+                    ws.message_length = 0;
+                }
+            }
+
+            memmove(ws.in, ws.in + header + length, ws.in_length - header - length);
+            ws.in_length -= header + length;
+        }
+
+        if (ws.in_length == sizeof(ws.in)) {
+            ws_close("frame too large");
+            return;
+        }
+    }
+}
+
+
+private boolean ws_open(void) {
+
+    /*
+    start connecting unless the last attempt was less than
+    WS_RECONNECT_INTERVAL ago, returns whether it did. the address is
+    only resolved when the last connect to it failed, or never happened
+    */
+
+    long long now = monotonic_micros();
+    if (ws.state != WS_DISCONNECTED || now - ws.last_connect_attempt < WS_RECONNECT_INTERVAL) return false;
+    ws.last_connect_attempt = now;
+
+    if (ws.address_length > 0) return ws_connect() == 0;
+
+    if (strncmp(api_url, "https", 5) == 0) {
+        fprintf(stderr, "websocket transport does not support https urls\n");
+        return false;
+    }
+
+    char *start = strstr(api_url, "://");
+    start = start ? start + 3 : api_url;
+    size_t host_length = strcspn(start, ":/");
+    if (host_length >= sizeof(ws.host)) return false;
+    memcpy(ws.host, start, host_length);
+    ws.host[host_length] = '\0';
+    strcpy(ws.port, "80");
+    if (start[host_length] == ':') {
+        size_t port_length = strcspn(start + host_length + 1, "/");
+        if (port_length >= sizeof(ws.port)) return false;
+        memcpy(ws.port, start + host_length + 1, port_length);
+        ws.port[port_length] = '\0';
+    }
+
+    pthread_t thread;
+    atomic_store(&ws.resolved, 0);
+    if (pthread_create(&thread, NULL, ws_resolve, NULL) != 0) {
+        fprintf(stderr, "websocket: could not start the resolver\n");
+        return false;
+    }
+    pthread_detach(thread);
+    ws.state = WS_RESOLVING;
+    return true;
+}
+
+
+private boolean ws_send(struct api_request *request) {
+
+    /*
+    translate "domain/service" and the json body into a call_service
+    message, the body already is the service data object
+    */
+
+    if (ws.state == WS_DISCONNECTED) ws_open();
+    if (ws.state != WS_READY) return false;
+
+    char *service = strchr(request->endpoint, '/');
+    if (service == NULL) return false;
+
+    char message[BODY_SIZE + 200];
+    request->ws_id = ++ws.next_id;
+    int length = snprintf(message, sizeof(message),
+        "{\"id\": %ld, \"type\": \"call_service\", \"domain\": \"%.*s\", \"service\": \"%s\", \"service_data\": %s}",
+        request->ws_id, (int)(service - request->endpoint), request->endpoint, service + 1, request->body);
+
+    if (ws_send_frame(WS_OPCODE_TEXT, message, length) != 0) {
+        ws_close("send failed");
+        return false;
+    }
+    return true;
+}
+
+
+/*
+state mirror
+*/
+
+private struct entity_state *mirror_lookup(char *entity_id) {
+    int i;
+    for (i = 0; i < entity_count; i++) {
+        if (strcmp(entities[i].entity_id, entity_id) == 0) return &entities[i];
+    }
+    return NULL;
+}
+
+
+private void mirror_invalidate(struct entity_state *entity) {
+    atomic_store(&leds_dirty, 1);
+    entity->state = -1;
+    entity->brightness_pct = -1;
+    entity->kelvin = -1;
+}
+
+
+void mirror_track(struct mapping_table *table) {
+
+    /* make sure every mapped entity, and every group member, has an entry to mirror into */
+
+    int i, j;
+    for (i = 1; i < table->action_count; i++) {
+        if (strchr(table->actions[i].entity_id, '.')) find_entity(table->actions[i].entity_id);
+    }
+    for (i = 0; i < table->group_count; i++) {
+        for (j = 0; j < table->groups[i].count; j++) find_entity(table->groups[i].entity_ids[j]);
+    }
+}
+
+
+private void mirror_parse(struct entity_state *entity, char *object) {
+
+    /*
+    read state, brightness and color_temp_kelvin out of one state object,
+    as found in /api/states and in trigger events. the search stops at
+    last_changed, which follows the attributes
+    */
+
+    char *end = strstr(object, "\"last_changed\"");
+    char saved = 0;
+    if (end) {
+        saved = *end;
+        *end = '\0';
+    }
+
+    mirror_invalidate(entity);           /* also marks the leds dirty */
+
+    if (json_has(object, "state", "\"on\"")) entity->state = 1;
+    else if (json_has(object, "state", "\"off\"")) entity->state = 0;
+
+    if (entity->state == 1) {
+        long brightness = json_find_long(object, "brightness", -1);
+        if (brightness >= 0) entity->brightness_pct = (brightness * 100 + 127) / 255;
+        entity->kelvin = json_find_long(object, "color_temp_kelvin", -1);
+    }
+
+    if (end) *end = saved;
+}
+
+
+private size_t mirror_seed_write(char *data, size_t size, size_t count, void *userdata) {
+    char *grown = realloc(mirror_seed_states, mirror_seed_length + size * count + 1);
+    if (grown == NULL) return 0;
+    memcpy(grown + mirror_seed_length, data, size * count);
+    mirror_seed_length += size * count;
+    grown[mirror_seed_length] = '\0';
+    mirror_seed_states = grown;
+    return size * count;
+}
+
+
+private void mirror_seed_stop(void) {
+
+    /* abandon the seed in flight, if any */
+
+    if (mirror_seed_easy) {
+        curl_multi_remove_handle(api_multi, mirror_seed_easy);
+        curl_easy_cleanup(mirror_seed_easy);
+        mirror_seed_easy = NULL;
+    }
+    free(mirror_seed_states);
+    mirror_seed_states = NULL;
+    mirror_seed_length = 0;
+}
+
+
+private void mirror_seed(void) {
+
+    /*
+    fetch /api/states on api_multi next to the service calls, api_poll
+    hands the result to mirror_seeded. a seed still in flight is
+    restarted, the tracked entities may have changed
+    */
+
+    char url[200];
+    snprintf(url, sizeof(url), "%s/api/states", api_url);
+
+    mirror_seed_stop();
+    mirror_seed_easy = curl_easy_init();
+    curl_easy_setopt(mirror_seed_easy, CURLOPT_URL, url);
+    curl_easy_setopt(mirror_seed_easy, CURLOPT_HTTPHEADER, api_headers);
+    curl_easy_setopt(mirror_seed_easy, CURLOPT_WRITEFUNCTION, mirror_seed_write);
+    curl_easy_setopt(mirror_seed_easy, CURLOPT_TIMEOUT_MS, 5000L);
+    curl_multi_add_handle(api_multi, mirror_seed_easy);
+    mirror_seed_started = monotonic_micros();
+}
+
+
+private void mirror_seeded(CURLcode response) {
+
+    /*
+    fill in every tracked entity from the finished seed, except the ones
+    an event or our own call mirrored while it ran: theirs is newer
+    */
+
+    long status = 0;
+    curl_easy_getinfo(mirror_seed_easy, CURLINFO_RESPONSE_CODE, &status);
+    char *states = mirror_seed_states;
+    mirror_seed_states = NULL;
+    mirror_seed_stop();
+
+    if (response != CURLE_OK || status != 200 || states == NULL) {
+        fprintf(stderr, "state mirror: could not read %s/api/states\n", api_url);
+        free(states);
+        return;
+    }
+
+    int i, seeded = 0;
+    for (i = 0; i < entity_count; i++) {
+        if (entities[i].entity_id[0] == '\0' || entities[i].mirrored_at > mirror_seed_started) continue;
+
+        char compact[80];
+        char spaced[80];
+        snprintf(compact, sizeof(compact), "\"entity_id\":\"%.49s\"", entities[i].entity_id);
+        snprintf(spaced, sizeof(spaced), "\"entity_id\": \"%.49s\"", entities[i].entity_id);
+
+        char *object = strstr(states, compact);
+        if (object == NULL) object = strstr(states, spaced);
+        if (object == NULL) continue;
+
+        mirror_parse(&entities[i], object);
+        seeded++;
+    }
+    free(states);
+
+    if (verbose) printf("state mirror: seeded %d of %d entities\n", seeded, entity_count);
+}
+
+
+private void mirror_subscribe(void) {
+
+    /*
+    subscribe to state changes of the tracked entities first, then seed,
+    so no change can fall between the two
+    */
+
+    char message[4096];
+    ws.subscribe_id = ++ws.next_id;
+    ws.subscribed = false;
+    int length = snprintf(message, sizeof(message),
+        "{\"id\": %ld, \"type\": \"subscribe_trigger\", \"trigger\": {\"platform\": \"state\", \"entity_id\": [", ws.subscribe_id);
+
+    int i, count = 0;
+    for (i = 0; i < entity_count && length < (int)sizeof(message) - 64; i++) {
+        if (entities[i].entity_id[0] == '@' || entities[i].entity_id[0] == '\0') continue;
+        length += snprintf(message + length, sizeof(message) - length, "%s\"%s\"", count++ ? ", " : "", entities[i].entity_id);
+    }
+    length += snprintf(message + length, sizeof(message) - length, "]}}");
+
+    if (count == 0) return;
+    if (ws_send_frame(WS_OPCODE_TEXT, message, length) != 0) {
+        ws_close("send failed");
+        return;
+    }
+
+    mirror_seed();
+}
+
+
+private void mirror_handle_event(char *message) {
+
+    /* a state trigger fired, the new state is in to_state */
+
+    char *to_state = strstr(message, "\"to_state\"");
+    if (to_state == NULL) return;
+
+    char entity_id[50];
+    char *found = strstr(to_state, "\"entity_id\"");
+    if (found == NULL) return;
+    found = strchr(found + 11, '"');
+    if (found == NULL) return;
+    size_t length = strcspn(found + 1, "\"");
+    if (length >= sizeof(entity_id)) return;
+    memcpy(entity_id, found + 1, length);
+    entity_id[length] = '\0';
+
+    struct entity_state *entity = mirror_lookup(entity_id);
+    if (entity == NULL) return;
+
+    mirror_parse(entity, to_state);
+    entity->mirrored_at = monotonic_micros();
+
+    /* the echo of our pending call, within home assistant's rounding */
+    if (entity->pending_until && entity->state == entity->pending_state &&
+            (entity->pending_brightness_pct < 0 || abs(entity->brightness_pct - entity->pending_brightness_pct) <= 1) &&
+            (entity->pending_kelvin < 0 || abs(entity->kelvin - entity->pending_kelvin) <= MIRROR_KELVIN_TOLERANCE)) {
+        entity->pending_until = 0;
+    }
+}
+
+
+private boolean mirror_drop(struct queued_call *call) {
+
+    /*
+    drop a dirty slot whose call would leave its entity as it is.
+    toggles always go out, groups are not mirrored as a whole
+    */
+
+    if (!mirror_enabled || ws.state != WS_READY || !ws.subscribed) return false;
+
+    struct entity_state *entity = &entities[call->entity];
+    if (entity->entity_id[0] == '@') return false;
+    if (entity->pending_until > monotonic_micros()) {
+        mirror_misses++;
+        return false;
+    }
+
+    char *data = strchr(body_data(call->body), ':');
+    long value = data ? strtol(data + 1, NULL, 10) : 0;
+    boolean redundant = false;
+
+    if (strcmp(call->attribute, "brightness") == 0) {
+        redundant = value == 0 ? entity->state == 0 : entity->state == 1 && entity->brightness_pct == value;
+    } else if (strcmp(call->attribute, "kelvin") == 0) {
+        redundant = entity->state == 1 && entity->kelvin >= 0 && labs(entity->kelvin - value) <= MIRROR_KELVIN_TOLERANCE;
+    } else if (strstr(call->endpoint, "/turn_off")) {
+        redundant = entity->state == 0;
+    }
+
+    if (!redundant) {
+        mirror_misses++;
+        return false;
+    }
+
+    mirror_hits++;
+    call->sequence = 0;
+    call_queue_dirty--;
+    if (verbose) printf("%s %s: unchanged, not sent\n", call->endpoint, entity->entity_id);
+    return true;
+}
+
+
+private void mirror_sent(struct queued_call *call) {
+
+    /*
+    assume the call succeeds, a failure invalidates the entry again.
+    what it sets is pending until its echo arrives
+    */
+
+    struct entity_state *entity = &entities[call->entity];
+    char *data = strchr(body_data(call->body), ':');
+    long value = data ? strtol(data + 1, NULL, 10) : 0;
+
+    atomic_store(&leds_dirty, 1);
+    entity->mirrored_at = monotonic_micros();
+    entity->pending_until = entity->mirrored_at + MIRROR_ECHO_WINDOW;
+    entity->pending_brightness_pct = -1;
+    entity->pending_kelvin = -1;
+
+    if (strcmp(call->attribute, "brightness") == 0) {
+        entity->state = value > 0;
+        entity->brightness_pct = value > 0 ? value : -1;
+        entity->pending_brightness_pct = entity->brightness_pct;
+    } else if (strcmp(call->attribute, "kelvin") == 0) {
+        entity->state = 1;
+        entity->kelvin = value;
+        entity->pending_kelvin = value;
+    } else if (strstr(call->endpoint, "/turn_off")) {
+        mirror_invalidate(entity);
+        entity->state = 0;
+    } else {
+        /* a toggle, nothing to expect: unknown until the next event */
+        mirror_invalidate(entity);
+        entity->pending_until = 0;
+    }
+    entity->pending_state = entity->state;
+}
+
+
+/*
+led feedback
+*/
+
+private boolean action_lit(struct mapping_table *table, struct action *action) {
+
+    /* a group is lit when any of its members is on */
+
+    if (action->entity_id[0] == '@') {
+        struct group *group = find_group(table, action->entity_id + 1);
+        int i;
+        for (i = 0; group && i < group->count; i++) {
+            struct entity_state *entity = mirror_lookup(group->entity_ids[i]);
+            if (entity && entity->state == 1) return true;
+        }
+        return false;
+    }
+
+    struct entity_state *entity = mirror_lookup(action->entity_id);
+    return entity && entity->state == 1;
+}
+
+
+private void write_leds(struct midi_device *device, PmEvent *batch, int count) {
+    if (count == 0) return;
+    led_writes += count;
+#ifdef M2HA_ALSA
+    if (use_alsa) {
+        alsa_write_leds(device, batch, count);
+        return;
+    }
+#endif
+    PmError err = Pm_Write(device->out, batch, count);
+    if (err) fprintf(stderr, "led write failed: %s\n", Pm_GetErrorText(err));
+}
+
+
+private long long render_leds(long long now) {
+
+    /*
+    send the leds that changed since the last frame, returns how long
+    until the next frame is allowed when one is pending, else -1
+    */
+
+    if (!atomic_load(&leds_dirty)) return -1;
+    if (now < led_frame_due) return led_frame_due - now;
+
+    atomic_store(&leds_dirty, 0);
+    led_frame_due = now + LED_FRAME;
+
+    /*
+    the table is taken like the midi thread takes it. tables are swapped
+    and freed on this thread, so it stays valid for the whole frame
+    without reporting an epoch. the shift layers are read atomically, the
+    midi thread sets them before it marks the leds dirty
+    */
+
+    struct mapping_table *table = atomic_load_explicit(&mappings, memory_order_acquire);
+    int d;
+
+    for (d = 0; d < device_count; d++) {
+        struct midi_device *device = &devices[d];
+        if (device->out == NULL && device->seq_out_port < 0) continue;
+
+        unsigned int channels = atomic_load(&device->channels_seen);
+        if (channels == 0) channels = 1;    /* nothing received yet, assume the default channel 1 */
+        int layer = atomic_load(&device->shift);
+
+        PmEvent batch[128];
+        int count = 0;
+        int channel, control;
+
+        for (channel = 0; channel < 16; channel++) {
+            if (!(channels & (1u << channel))) continue;
+
+            for (control = 0; control < 128; control++) {
+                int index = lookup_action(table, d, layer, MAPPING_KIND_CC, channel, control);
+                if (index == 0) continue;
+
+                struct action *action = &table->actions[index];
+                if (action->type != ACTION_TURN_OFF && action->type != ACTION_TOGGLE && action->type != ACTION_LED) continue;
+
+                unsigned char wanted = action_lit(table, action) ? 127 : 0;
+                if (device->led_sent[channel][control] == wanted) continue;
+
+                device->led_sent[channel][control] = wanted;
+                batch[count].message = Pm_Message(MIDI_CONTROL_CHANGE | channel, control, wanted);
+                batch[count].timestamp = 0;
+                if (++count == 128) {
+                    write_leds(device, batch, count);
+                    count = 0;
+                }
+            }
+        }
+
+        write_leds(device, batch, count);
+    }
+    return -1;
+}
+
+
+private void leds_off(struct midi_device *device) {
+
+    /* leave the controller dark on exit */
+
+    PmEvent batch[128];
+    int count = 0;
+    int channel, control;
+
+    for (channel = 0; channel < 16; channel++) {
+        for (control = 0; control < 128; control++) {
+            if (device->led_sent[channel][control] != 127) continue;
+            batch[count].message = Pm_Message(MIDI_CONTROL_CHANGE | channel, control, 0);
+            batch[count].timestamp = 0;
+            if (++count == 128) {
+                write_leds(device, batch, count);
+                count = 0;
+            }
+        }
+    }
+    write_leds(device, batch, count);
+}
+
+
+/*
+devices
+*/
+
+private boolean wait_for_midi_thread(void) {
+
+    /*
+    return once the midi thread finished a poll that began after this
+    call, from then on it no longer uses a table swapped out or a device
+    closed before it. it polls every millisecond, give it a generous second
+    */
+
+    /* with alsa, input is handled on this thread */
+    if (use_alsa) return true;
+
+    unsigned int epoch = atomic_fetch_add(&mapping_epoch, 1) + 1;
+    long long started = monotonic_micros();
+
+    while ((int)(atomic_load_explicit(&midi_thread_epoch, memory_order_acquire) - epoch) < 0) {
+        if (monotonic_micros() - started > 1000000) return false;
+        usleep(200);
+    }
+    return true;
+}
+
+
+private int attach_devices(void) {
+
+    /*
+    open every device that is not connected and is in portmidi's list,
+    returns how many were. an input already opened is skipped, so two
+    controllers with the same name are told apart by the order of -d
+    */
+
+    int attached = 0;
+    int d, i;
+
+    for (d = 0; d < device_count; d++) {
+        struct midi_device *device = &devices[d];
+        if (device->in) continue;
+
+        int input = -1;
+        int output = -1;
+        for (i = 0; i < Pm_CountDevices(); i++) {
+            const PmDeviceInfo *info = Pm_GetDeviceInfo(i);
+            if (info->opened) continue;
+            if (input == -1 && info->input && strcmp(info->name, device->name) == 0) input = i;
+            if (output == -1 && info->output && device->output_name && strcmp(info->name, device->output_name) == 0) output = i;
+        }
+        if (input == -1) continue;
+
+        PmError err = Pm_OpenInput(&device->in, input, NULL, 512, NULL, NULL);
+        if (err) {
+            printf("Could not open midi device '%s': %s\n", device->name, Pm_GetErrorText(err));
+            device->in = NULL;
+            continue;
+        }
+        atomic_store(&device->lost, 0);
+        attached++;
+        if (device->reopen) {
+            device->reopen = false;
+            if (output != -1 && Pm_OpenOutput(&device->out, output, NULL, 256, NULL, NULL, 0) != pmNoError) device->out = NULL;
+            continue;
+        }
+        printf("Midi device opened: %s\n", device->name);
+
+        /* leds are optional, without an output the controller just stays dark */
+        memset(device->led_sent, LED_UNKNOWN, sizeof(device->led_sent));
+        if (device->output_name == NULL) continue;
+        if (output == -1) {
+            printf("No midi output '%s', led feedback disabled.\n", device->output_name);
+            continue;
+        }
+        err = Pm_OpenOutput(&device->out, output, NULL, 256, NULL, NULL, 0);
+        if (err) {
+            printf("Could not open midi output '%s': %s\n", device->output_name, Pm_GetErrorText(err));
+            device->out = NULL;
+        }
+    }
+
+    if (attached) atomic_store(&leds_dirty, 1);
+    return attached;
+}
+
+
+private void close_device(struct midi_device *device, boolean dark) {
+
+    /* the midi thread must not be reading it, see wait_for_midi_thread */
+
+    if (device->in) Pm_Close(device->in);
+    if (device->out) {
+        if (dark) leds_off(device);
+        Pm_Close(device->out);
+    }
+    if (device->seq_out_port >= 0 && dark) leds_off(device);
+    device->in = NULL;
+    device->out = NULL;
+    device->seq_port = -1;
+    device->seq_out_port = -1;
+    reset_input_state(device);
+}
+
+
+private void reset_input_state(struct midi_device *device) {
+
+    /*
+    forget what its input left behind, the shift layer and half received
+    14 bit values, so a device comes back as if nothing was held
+    */
+
+    int channel;
+    atomic_store(&device->shift, 0);
+    memset(device->channels, 0, sizeof(device->channels));
+    for (channel = 0; channel < 16; channel++) device->channels[channel].nrpn = -1;
+    atomic_store(&leds_dirty, 1);
+}
+
+
+private long long rescan_devices(long long now) {
+
+    /*
+    look for missing devices and replace lost ones. portmidi only lists
+    the devices present when it was initialized, so this closes every
+    device and initializes it again, which drops a few milliseconds of
+    input. to keep that rare it only happens when a device was lost or
+    /dev/snd changed (a device was plugged in), checked every
+    DEVICE_RESCAN. without /dev/snd (not alsa) it happens every time.
+    returns how long until the next check, -1 when all are connected
+    */
+
+    boolean lost = false;
+    boolean missing = false;
+    int d;
+
+    for (d = 0; d < device_count; d++) {
+        if (devices[d].in && atomic_load(&devices[d].lost)) lost = true;
+        if (devices[d].in == NULL) missing = true;
+    }
+    if (!lost && !missing) return -1;
+    if (!lost && now < device_rescan_due) return device_rescan_due - now;
+    device_rescan_due = now + DEVICE_RESCAN;
+
+    struct stat nodes;
+    if (stat("/dev/snd", &nodes) == 0) {
+        boolean changed = nodes.st_mtim.tv_sec != device_nodes_changed.tv_sec || nodes.st_mtim.tv_nsec != device_nodes_changed.tv_nsec;
+        device_nodes_changed = nodes.st_mtim;
+        if (!lost && !changed) return DEVICE_RESCAN;
+    }
+
+    active = false;
+    if (!wait_for_midi_thread()) {
+        active = true;
+        return DEVICE_RESCAN;
+    }
+
+    for (d = 0; d < device_count; d++) {
+        if (devices[d].in == NULL) continue;
+        if (atomic_load(&devices[d].lost)) printf("Midi device lost: %s\n", devices[d].name);
+        else devices[d].reopen = true;
+        close_device(&devices[d], false);
+    }
+    Pm_Terminate();
+    Pm_Initialize();
+    attach_devices();
+    active = true;
+
+    return DEVICE_RESCAN;
+}
+
+
+/*
+metrics
+*/
+
+private int metrics_open(void) {
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_port = htons(metrics_port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (fd == -1 || bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(fd, METRICS_MAX_CLIENTS) != 0) {
+        fprintf(stderr, "metrics: could not listen on 127.0.0.1:%d: %s\n", metrics_port, strerror(errno));
+        if (fd != -1) close(fd);
+        return -1;
+    }
+
+    int i;
+    for (i = 0; i < METRICS_MAX_CLIENTS; i++) metrics_clients[i].fd = -1;
+    metrics_fd = fd;
+    printf("Metrics on http://127.0.0.1:%d/metrics\n", metrics_port);
+    return 0;
+}
+
+
+private void metrics_drop(struct metrics_client *client) {
+    close(client->fd);
+    free(client->response);
+    client->fd = -1;
+    client->response = NULL;
+}
+
+
+private void metrics_close(void) {
+    int i;
+    if (metrics_fd == -1) return;
+    for (i = 0; i < METRICS_MAX_CLIENTS; i++) {
+        if (metrics_clients[i].fd != -1) metrics_drop(&metrics_clients[i]);
+    }
+    close(metrics_fd);
+    metrics_fd = -1;
+}
+
+
+private char *metrics_label(char *escaped, size_t size, const char *value) {
+
+    /* a label value with backslash, double quote and newline escaped, as the text format wants */
+
+    size_t length = 0;
+    for (; *value && length + 3 < size; value++) {
+        if (*value == '\n') {
+            escaped[length++] = '\\';
+            escaped[length++] = 'n';
+            continue;
+        }
+        if (*value == '\\' || *value == '"') escaped[length++] = '\\';
+        escaped[length++] = *value;
+    }
+    escaped[length] = '\0';
+    return escaped;
+}
+
+
+private void metrics_render(FILE *out) {
+
+    /*
+    the text exposition format. rates, like midi events per second, are
+    left to the scraper. the latency histograms are summed into the
+    fixed buckets below from their finer log-linear ones, so a bound
+    may be off by a bucket's width (~6%)
+    */
+
+    static const long long bounds[] = { 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000, 5000000 };
+    static const char *status_classes[] = { "none", "1xx", "2xx", "3xx", "4xx", "5xx" };
+    char label[256];
+    int i, j;
+
+    fprintf(out, "# HELP m2ha_midi_events_total MIDI events read, per controller.\n# TYPE m2ha_midi_events_total counter\n");
+    for (i = 0; i < device_count; i++) {
+        fprintf(out, "m2ha_midi_events_total{device=\"%s\"} %lu\n", metrics_label(label, sizeof(label), devices[i].name), atomic_load(&devices[i].events));
+    }
+    fprintf(out, "# HELP m2ha_midi_collapsed_total MIDI events superseded by a later one in the same batch.\n# TYPE m2ha_midi_collapsed_total counter\n");
+    fprintf(out, "m2ha_midi_collapsed_total %lu\n", atomic_load(&midi_collapsed));
+
+    fprintf(out, "# HELP m2ha_filter_values_total Fader and knob values by filter result.\n# TYPE m2ha_filter_values_total counter\n");
+    fprintf(out, "m2ha_filter_values_total{result=\"passed\"} %lu\n", atomic_load(&filter_passed));
+    fprintf(out, "m2ha_filter_values_total{result=\"dropped\"} %lu\n", atomic_load(&filter_dropped));
+    fprintf(out, "# HELP m2ha_updates_coalesced_total Queued values overwritten by a newer one before sending.\n# TYPE m2ha_updates_coalesced_total counter\n");
+    fprintf(out, "m2ha_updates_coalesced_total %lu\n", atomic_load(&updates_coalesced));
+    fprintf(out, "# HELP m2ha_updates_merged_total Updates sent in another entity's call.\n# TYPE m2ha_updates_merged_total counter\n");
+    fprintf(out, "m2ha_updates_merged_total %ld\n", api_stats.merged);
+    fprintf(out, "# HELP m2ha_updates_dropped_total Updates dropped because the ring or queue was full.\n# TYPE m2ha_updates_dropped_total counter\n");
+    fprintf(out, "m2ha_updates_dropped_total %lu\n", atomic_load(&updates_dropped));
+
+    fprintf(out, "# HELP m2ha_api_requests_total Service calls answered, by http status class.\n# TYPE m2ha_api_requests_total counter\n");
+    for (i = 0; i < 6; i++) {
+        if (api_stats.statuses[i] || i == 2) fprintf(out, "m2ha_api_requests_total{code=\"%s\"} %ld\n", status_classes[i], api_stats.statuses[i]);
+    }
+    fprintf(out, "# HELP m2ha_api_connections_total Connections opened, the other requests reused one.\n# TYPE m2ha_api_connections_total counter\n");
+    fprintf(out, "m2ha_api_connections_total %ld\n", api_stats.connects);
+    fprintf(out, "# HELP m2ha_api_connection_reuse_ratio Share of requests sent on an open connection.\n# TYPE m2ha_api_connection_reuse_ratio gauge\n");
+    fprintf(out, "m2ha_api_connection_reuse_ratio %g\n",
+        api_stats.requests > api_stats.connects ? 1.0 - (double)api_stats.connects / api_stats.requests : 0.0);
+    fprintf(out, "# HELP m2ha_api_in_flight Service calls waiting on a response.\n# TYPE m2ha_api_in_flight gauge\n");
+    fprintf(out, "m2ha_api_in_flight %d\n", api_in_flight);
+    fprintf(out, "# HELP m2ha_api_unreachable 1 while home assistant can't be reached.\n# TYPE m2ha_api_unreachable gauge\n");
+    fprintf(out, "m2ha_api_unreachable %d\n", api_backoff.failures > 0);
+    fprintf(out, "# HELP m2ha_api_outages_total Times home assistant became unreachable.\n# TYPE m2ha_api_outages_total counter\n");
+    fprintf(out, "m2ha_api_outages_total %ld\n", api_backoff.outages);
+
+    fprintf(out, "# HELP m2ha_call_queue_depth Entity values waiting to be sent.\n# TYPE m2ha_call_queue_depth gauge\n");
+    fprintf(out, "m2ha_call_queue_depth %d\n", call_queue_dirty);
+    fprintf(out, "# HELP m2ha_command_ring_depth Commands from the midi thread not yet drained.\n# TYPE m2ha_command_ring_depth gauge\n");
+    fprintf(out, "m2ha_command_ring_depth %u\n", atomic_load(&command_ring.head) - atomic_load(&command_ring.tail));
+    fprintf(out, "# HELP m2ha_command_ring_overflow_total Commands dropped because the ring was full.\n# TYPE m2ha_command_ring_overflow_total counter\n");
+    fprintf(out, "m2ha_command_ring_overflow_total %lu\n", atomic_load(&command_ring.overflow));
+
+    if (mirror_enabled) {
+        fprintf(out, "# HELP m2ha_mirror_hits_total Calls not sent because they would change nothing.\n# TYPE m2ha_mirror_hits_total counter\n");
+        fprintf(out, "m2ha_mirror_hits_total %ld\n", mirror_hits);
+        fprintf(out, "# HELP m2ha_mirror_misses_total Calls checked against the state mirror and sent.\n# TYPE m2ha_mirror_misses_total counter\n");
+        fprintf(out, "m2ha_mirror_misses_total %ld\n", mirror_misses);
+    }
+
+    fprintf(out, "# HELP m2ha_latency_seconds Latency of each pipeline stage.\n# TYPE m2ha_latency_seconds histogram\n");
+    for (i = 0; i < STAGE_COUNT; i++) {
+        struct histogram *histogram = &histograms[i];
+        unsigned long cumulative = 0;
+        int bucket = 0;
+        for (j = 0; j < (int)(sizeof(bounds) / sizeof(bounds[0])); j++) {
+            for (; bucket < HISTOGRAM_BUCKETS && histogram_bucket_max(bucket) <= bounds[j]; bucket++) {
+                cumulative += atomic_load_explicit(&histogram->counts[bucket], memory_order_relaxed);
+            }
+            fprintf(out, "m2ha_latency_seconds_bucket{stage=\"%s\",le=\"%g\"} %lu\n", histogram->label, bounds[j] / 1000000.0, cumulative);
+        }
+        unsigned long samples = atomic_load(&histogram->samples);
+        fprintf(out, "m2ha_latency_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %lu\n", histogram->label, samples);
+        fprintf(out, "m2ha_latency_seconds_sum{stage=\"%s\"} %.6f\n", histogram->label, atomic_load(&histogram->sum) / 1000000.0);
+        fprintf(out, "m2ha_latency_seconds_count{stage=\"%s\"} %lu\n", histogram->label, samples);
+    }
+
+    fprintf(out, "# HELP m2ha_entity_calls_total Service calls per entity, by result.\n# TYPE m2ha_entity_calls_total counter\n");
+    for (i = 0; i < entity_count; i++) {
+        if (entities[i].entity_id[0] == '\0') continue;
+        fprintf(out, "m2ha_entity_calls_total{entity=\"%s\",result=\"sent\"} %ld\n", metrics_label(label, sizeof(label), entities[i].entity_id), entities[i].sent);
+        fprintf(out, "m2ha_entity_calls_total{entity=\"%s\",result=\"failed\"} %ld\n", metrics_label(label, sizeof(label), entities[i].entity_id), entities[i].failed);
+    }
+    fprintf(out, "# HELP m2ha_entity_interval_seconds Current send interval of each entity.\n# TYPE m2ha_entity_interval_seconds gauge\n");
+    for (i = 0; i < entity_count; i++) {
+        if (entities[i].entity_id[0] == '\0') continue;
+        fprintf(out, "m2ha_entity_interval_seconds{entity=\"%s\"} %g\n", metrics_label(label, sizeof(label), entities[i].entity_id), entities[i].interval / 1000000.0);
+    }
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    fprintf(out, "# HELP process_cpu_seconds_total Total user and system CPU time spent in seconds.\n# TYPE process_cpu_seconds_total counter\n");
+    fprintf(out, "process_cpu_seconds_total %.3f\n", usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+        (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000000.0);
+
+    long pages = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm) {
+        if (fscanf(statm, "%*d %ld", &pages) != 1) pages = 0;
+        fclose(statm);
+    }
+    fprintf(out, "# HELP process_resident_memory_bytes Resident memory size in bytes.\n# TYPE process_resident_memory_bytes gauge\n");
+    fprintf(out, "process_resident_memory_bytes %ld\n", pages * sysconf(_SC_PAGESIZE));
+}
+
+
+private void metrics_respond(struct metrics_client *client) {
+
+    /* only GET /metrics is served, the response is sent as the socket takes it */
+
+    char *body = NULL;
+    size_t body_length = 0;
+    char *status = "200 OK";
+
+    FILE *out = open_memstream(&body, &body_length);
+    if (strncmp(client->request, "GET /metrics ", 13) == 0 || strncmp(client->request, "GET /metrics?", 13) == 0) {
+        metrics_render(out);
+        metrics_scrapes++;
+    } else {
+        status = "404 Not Found";
+        fprintf(out, "m2ha serves GET /metrics\n");
+    }
+    fclose(out);
+
+    char header[200];
+    int header_length = snprintf(header, sizeof(header),
+        "HTTP/1.1 %s\r\n"
+        "Content-Type: text/plain; version=0.0.4\r\n"
+        "Content-Length: %zu\r\n"
+        "Connection: close\r\n\r\n", status, body_length);
+
+    client->response = malloc(header_length + body_length);
+    memcpy(client->response, header, header_length);
+    memcpy(client->response + header_length, body, body_length);
+    client->response_length = header_length + body_length;
+    client->sent = 0;
+    free(body);
+}
+
+
+private void metrics_poll(void) {
+
+    /* accept, read and answer whatever is ready, never blocking */
+
+    int i, fd;
+    while ((fd = accept4(metrics_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1) {
+        struct metrics_client *client = NULL;
+        for (i = 0; i < METRICS_MAX_CLIENTS; i++) {
+            if (metrics_clients[i].fd == -1) {
+                client = &metrics_clients[i];
+                break;
+            }
+            if (client == NULL || metrics_clients[i].opened < client->opened) client = &metrics_clients[i];
+        }
+        if (client->fd != -1) metrics_drop(client);
+
+        client->fd = fd;
+        client->request_length = 0;
+        client->opened = monotonic_micros();
+    }
+
+    for (i = 0; i < METRICS_MAX_CLIENTS; i++) {
+        struct metrics_client *client = &metrics_clients[i];
+        if (client->fd == -1) continue;
+
+        if (client->response == NULL) {
+            ssize_t received = recv(client->fd, client->request + client->request_length,
+                sizeof(client->request) - 1 - client->request_length, 0);
+            if (received == 0 || (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+                metrics_drop(client);
+                continue;
+            }
+            if (received > 0) client->request_length += received;
+            client->request[client->request_length] = '\0';
+
+            if (strstr(client->request, "\r\n\r\n") == NULL) {
+                if (client->request_length == sizeof(client->request) - 1) metrics_drop(client);
+                continue;
+            }
+            metrics_respond(client);
+        }
+
+        ssize_t written = send(client->fd, client->response + client->sent, client->response_length - client->sent, MSG_NOSIGNAL);
+        if (written < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            metrics_drop(client);
+            continue;
+        }
+        if (written > 0) client->sent += written;
+        if (client->sent == client->response_length) metrics_drop(client);
+    }
+}
+
+
+#ifdef M2HA_ALSA
+
+/*
+alsa sequencer
+*/
+
+private void alsa_attach_devices(void) {
+
+    /*
+    connect every device that is not connected to the first free port of
+    its name. a device's leds go to a port named like its input on the
+    same client, or to any port of the name given with -o
+    */
+
+    snd_seq_client_info_t *client_info;
+    snd_seq_port_info_t *port_info;
+    snd_seq_client_info_alloca(&client_info);
+    snd_seq_port_info_alloca(&port_info);
+
+    boolean attached[MAX_DEVICES] = { false };
+    int d, other;
+
+    snd_seq_client_info_set_client(client_info, -1);
+    while (snd_seq_query_next_client(seq, client_info) >= 0) {
+        int client = snd_seq_client_info_get_client(client_info);
+        if (client == snd_seq_client_id(seq)) continue;
+
+        snd_seq_port_info_set_client(port_info, client);
+        snd_seq_port_info_set_port(port_info, -1);
+        while (snd_seq_query_next_port(seq, port_info) >= 0) {
+            const char *name = snd_seq_port_info_get_name(port_info);
+            unsigned int caps = snd_seq_port_info_get_capability(port_info);
+            int port = snd_seq_port_info_get_port(port_info);
+            boolean readable = (caps & (SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_SUBS_READ)) == (SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_SUBS_READ);
+            boolean writable = (caps & (SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE)) == (SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE);
+
+            for (d = 0; readable && d < device_count; d++) {
+                struct midi_device *device = &devices[d];
+                if (device->seq_port >= 0 || strcmp(name, device->name) != 0) continue;
+
+                for (other = 0; other < device_count; other++) {
+                    if (devices[other].seq_port == port && devices[other].seq_client == client) break;
+                }
+                if (other < device_count) break;       /* taken by another device of this name */
+
+                int err = snd_seq_connect_from(seq, seq_input, client, port);
+                if (err < 0) {
+                    printf("Could not connect midi device '%s': %s\n", device->name, snd_strerror(err));
+                    continue;
+                }
+                device->seq_client = client;
+                device->seq_port = port;
+                attached[d] = true;
+                printf("Midi device opened: %s (%d:%d)\n", device->name, client, port);
+                break;
+            }
+
+            for (d = 0; writable && d < device_count; d++) {
+                struct midi_device *device = &devices[d];
+                if (device->seq_port < 0 || device->seq_out_port >= 0 || device->output_name == NULL) continue;
+                if (strcmp(name, device->output_name) != 0) continue;
+                if (strcmp(device->output_name, device->name) == 0 && client != device->seq_client) continue;
+
+                device->seq_out_client = client;
+                device->seq_out_port = port;
+                break;
+            }
+        }
+    }
+
+    for (d = 0; d < device_count; d++) {
+        if (!attached[d]) continue;
+        memset(devices[d].led_sent, LED_UNKNOWN, sizeof(devices[d].led_sent));
+        if (devices[d].output_name && devices[d].seq_out_port < 0) {
+            printf("No midi output '%s', led feedback disabled.\n", devices[d].output_name);
+        }
+        atomic_store(&leds_dirty, 1);
+    }
+}
+
+
+private int alsa_open(void) {
+
+    int err = snd_seq_open(&seq, "default", SND_SEQ_OPEN_DUPLEX, SND_SEQ_NONBLOCK);
+    if (err < 0) {
+        fprintf(stderr, "alsa: could not open the sequencer: %s\n", snd_strerror(err));
+        seq = NULL;
+        return -1;
+    }
+
+    snd_seq_set_client_name(seq, "m2ha");
+    seq_input = snd_seq_create_simple_port(seq, "m2ha in", SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE,
+        SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_APPLICATION);
+    seq_output = snd_seq_create_simple_port(seq, "m2ha out", SND_SEQ_PORT_CAP_READ | SND_SEQ_PORT_CAP_SUBS_READ,
+        SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_APPLICATION);
+    if (seq_input < 0 || seq_output < 0) {
+        fprintf(stderr, "alsa: could not create ports: %s\n", snd_strerror(seq_input < 0 ? seq_input : seq_output));
+        snd_seq_close(seq);
+        seq = NULL;
+        return -1;
+    }
+
+    /* the system client announces ports coming and going */
+    snd_seq_connect_from(seq, seq_input, SND_SEQ_CLIENT_SYSTEM, SND_SEQ_PORT_SYSTEM_ANNOUNCE);
+
+    struct pollfd descriptor;
+    snd_seq_poll_descriptors(seq, &descriptor, 1, POLLIN);
+    seq_fd = descriptor.fd;
+
+    alsa_attach_devices();
+    return 0;
+}
+
+
+private void alsa_handle_batch(struct midi_device *device, int count, struct mapping_table *table) {
+    if (record_file) record_midi(device - devices, midi_batch, count);
+    handle_midi_batch(device, count, table);
+
+    /* the ring is drained on this thread too, keep it from filling up */
+    drain_command_ring();
+}
+
+
+private void alsa_read(void) {
+
+    /*
+    handle everything the sequencer has queued, in batches of
+    consecutive events from one device like the midi thread reads them
+    */
+
+    struct mapping_table *table = atomic_load(&mappings);
+    struct midi_device *batch_device = NULL;
+    PtTimestamp now = Pt_Time();
+    boolean announced = false;
+    int count = 0;
+    int d, err;
+    snd_seq_event_t *event;
+
+    while ((err = snd_seq_event_input(seq, &event)) >= 0 || err == -ENOSPC) {
+        if (err == -ENOSPC) {
+            fprintf(stderr, "alsa: input overrun, events were lost\n");
+            continue;
+        }
+
+        if (event->source.client == SND_SEQ_CLIENT_SYSTEM) {
+            if (event->type == SND_SEQ_EVENT_PORT_START) announced = true;
+            if (event->type != SND_SEQ_EVENT_PORT_EXIT && event->type != SND_SEQ_EVENT_CLIENT_EXIT) continue;
+
+            for (d = 0; d < device_count; d++) {
+                struct midi_device *device = &devices[d];
+                if (device->seq_port < 0 || device->seq_client != event->data.addr.client) continue;
+                if (event->type == SND_SEQ_EVENT_PORT_EXIT && device->seq_port != event->data.addr.port) continue;
+                printf("Midi device lost: %s\n", device->name);
+                device->seq_port = -1;
+                device->seq_out_port = -1;
+                reset_input_state(device);
+            }
+            continue;
+        }
+
+        PmMessage message;
+        switch (event->type) {
+            case SND_SEQ_EVENT_CONTROLLER:
+                message = Pm_Message(MIDI_CONTROL_CHANGE | event->data.control.channel, event->data.control.param, event->data.control.value);
+                break;
+            case SND_SEQ_EVENT_NOTEON:
+                message = Pm_Message(MIDI_NOTE_ON | event->data.note.channel, event->data.note.note, event->data.note.velocity);
+                break;
+            case SND_SEQ_EVENT_NOTEOFF:
+                message = Pm_Message(MIDI_NOTE_OFF | event->data.note.channel, event->data.note.note, event->data.note.velocity);
+                break;
+            default:
+                continue;
+        }
+
+        for (d = 0; d < device_count; d++) {
+            if (devices[d].seq_port == event->source.port && devices[d].seq_client == event->source.client) break;
+        }
+        if (d == device_count) continue;
+
+        if (count > 0 && (batch_device != &devices[d] || count == MIDI_BATCH_SIZE)) {
+            alsa_handle_batch(batch_device, count, table);
+            count = 0;
+        }
+        batch_device = &devices[d];
+        midi_batch[count].message = message;
+        midi_batch[count].timestamp = now;
+        count++;
+    }
+
+    if (count > 0) alsa_handle_batch(batch_device, count, table);
+    if (announced) alsa_attach_devices();
+}
+
+
+private void alsa_write_leds(struct midi_device *device, PmEvent *batch, int count) {
+
+    /* sent directly to the device's port, no subscription needed */
+
+    int i;
+    for (i = 0; i < count; i++) {
+        PmMessage message = batch[i].message;
+        snd_seq_event_t event;
+        snd_seq_ev_clear(&event);
+        snd_seq_ev_set_source(&event, seq_output);
+        snd_seq_ev_set_dest(&event, device->seq_out_client, device->seq_out_port);
+        snd_seq_ev_set_direct(&event);
+        snd_seq_ev_set_controller(&event, Pm_MessageStatus(message) & MIDI_CHN_MASK, Pm_MessageData1(message), Pm_MessageData2(message));
+        snd_seq_event_output(seq, &event);
+    }
+
+    int err = snd_seq_drain_output(seq);
+    if (err < 0) fprintf(stderr, "led write failed: %s\n", snd_strerror(err));
+}
+
+#endif
+
+
+/*
+benchmark
+*/
+
+#ifdef M2HA_BENCH
+
+/* linked with -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc, libcurl's own allocations are not seen */
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *pointer, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    atomic_fetch_add_explicit(&bench_allocations, 1, memory_order_relaxed);
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+    atomic_fetch_add_explicit(&bench_allocations, 1, memory_order_relaxed);
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *pointer, size_t size) {
+    atomic_fetch_add_explicit(&bench_allocations, 1, memory_order_relaxed);
+    return __real_realloc(pointer, size);
+}
+
+#endif
+
+
+private void run_bench(int seconds) {
+
+    /*
+    for the given time build full batches of cc messages sweeping the
+    mapped faders and pots, and push them through collapse, lookup,
+    the ring and the coalescing slots on this thread, letting the
+    flush send whatever the throttle allows in between. then wait for
+    the last calls and report. ns per event covers the midi path up
+    to the queue, once per event read and once per event left after
+    the collapse, requests per second the whole run. a control mapped
+    on several channels (the built in layout copies channel 0 to all
+    16) is swept once
+    */
+
+    struct mapping_table *table = atomic_load(&mappings);
+    int controls[BENCH_MAX_CONTROLS];
+    int actions[BENCH_MAX_CONTROLS];
+    int control_count = 0;
+    int channel, control, i;
+
+    for (channel = 0; channel < 16 && control_count < BENCH_MAX_CONTROLS; channel++) {
+        for (control = 0; control < 128 && control_count < BENCH_MAX_CONTROLS; control++) {
+            int action = lookup_action(table, 0, 0, MAPPING_KIND_CC, channel, control);
+            enum action_type type = table->actions[action].type;
+            if (type != ACTION_BRIGHTNESS && type != ACTION_KELVIN) continue;
+            for (i = 0; i < control_count && actions[i] != action; i++);
+            if (i < control_count) continue;
+            actions[control_count] = action;
+            controls[control_count++] = channel << 8 | control;
+        }
+    }
+    if (control_count == 0) {
+        printf("bench: no fader or pot is mapped\n");
+        return;
+    }
+
+    printf("bench: %d controls for %ds against %s (%s)\n", control_count, seconds, api_url, transport);
+
+    long events = 0;
+    unsigned long collapsed = atomic_load(&midi_collapsed);
+    long long path_micros = 0;
+    long requests = api_stats.requests;
+    unsigned long allocations = atomic_load(&bench_allocations);
+    long long start = monotonic_micros();
+    long long now = start;
+
+    while (!done && now - start < seconds * 1000000LL) {
+        PtTimestamp timestamp = Pt_Time();
+        for (i = 0; i < MIDI_BATCH_SIZE; i++) {
+            int target = controls[(events + i) % control_count];
+            midi_batch[i].message = Pm_Message(MIDI_CONTROL_CHANGE | target >> 8, target & 0xff, (events + i) / control_count % 128);
+            midi_batch[i].timestamp = timestamp;
+        }
+
+        long long arrived = monotonic_micros();
+        handle_midi_batch(&devices[0], MIDI_BATCH_SIZE, table);
+        drain_command_ring();
+        now = monotonic_micros();
+        path_micros += now - arrived;
+        events += MIDI_BATCH_SIZE;
+
+        api_poll();
+        flush_api_calls(now);
+    }
+
+    long long storm_micros = now - start;
+    allocations = atomic_load(&bench_allocations) - allocations;
+    long handled = events - (long)(atomic_load(&midi_collapsed) - collapsed);
+
+    while (!done) {
+        api_poll();
+        long long timeout = flush_api_calls(monotonic_micros());
+        if (call_queue_dirty == 0 && api_in_flight == 0) break;
+        wait_for_work(timeout);
+    }
+
+    long long elapsed = monotonic_micros() - start;
+    requests = api_stats.requests - requests;
+
+    printf("bench: %ld events in %.2fs, %.0f events/s, %.1f ns/event\n",
+        events, storm_micros / 1e6, events * 1e6 / storm_micros, path_micros * 1000.0 / events);
+    printf("bench: %ld events handled after the collapse, %.1f ns/handled event\n",
+        handled, handled ? path_micros * 1000.0 / handled : 0.0);
+#ifdef M2HA_BENCH
+    printf("bench: %.4f allocations/event\n", (double)allocations / events);
+#endif
+    printf("bench: %ld requests in %.2fs, %.0f requests/s\n", requests, elapsed / 1e6, requests * 1e6 / elapsed);
+}
@@ -0,0 +1,286 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include "portmidi.h"
+#include "porttime.h"
+
+/*
+
+    headless stand-in for the portmidi and porttime libraries, link it
+    instead of -lportmidi to run m2ha without a controller:
+
+        gcc -o dist/m2ha_headless src/m2ha.c src/pm_stub.c -lcurl -lpthread
+
+    every controller has an input and an output device, named like the
+    nanoKONTROL2 or by $PM_STUB_DEVICE, a comma separated list for more
+    than one. input is read from the files in $PM_STUB_INPUT, in the
+    same order, one message per line. like tail -f they are read from
+    their end when opened, so events can be appended while m2ha runs:
+
+        <status> <data1> <data2>        eg: 0xb0 0 127
+
+    a controller is only listed while its input file exists, so creating
+    the file plugs it in (seen at the next Pm_Initialize) and removing
+    it unplugs it, reading then fails.
+
+    every message written to an output is logged to $PM_STUB_OUTPUT
+    (stderr when unset), one line per message, controllers numbered from 1:
+
+        <millis> <controller> out <status> <data1> <data2>
+
+*/
+
+#define MAX_STUB_DEVICES 8
+
+struct stub_device {
+    char name[100];
+    char path[200];                     /* input file, empty for none */
+    FILE *input;
+    int number;
+    int input_stream;                   /* only their addresses are handed out */
+    int output_stream;
+};
+
+static struct stub_device stubs[MAX_STUB_DEVICES];
+static PmDeviceInfo devices[MAX_STUB_DEVICES * 2];
+static int device_count = -1;           /* -1 until initialized */
+static FILE *output = NULL;
+static int outputs_open = 0;
+
+static struct timespec time_zero;
+static PtCallback *timer_callback = NULL;
+static void *timer_data = NULL;
+static int timer_resolution = 1;
+static volatile int timer_running = 0;
+static pthread_t timer_thread;
+
+/*
+devices
+*/
+
+static char *list_item(char *list, int index, char *out, size_t size) {
+    /* the index-th entry of a comma separated list, NULL past the end */
+    while (index-- > 0) {
+        list = strchr(list, ',');
+        if (list == NULL) return NULL;
+        list++;
+    }
+    size_t length = strcspn(list, ",");
+    if (length >= size) length = size - 1;
+    memcpy(out, list, length);
+    out[length] = '\0';
+    return out;
+}
+
+static void init_devices(void) {
+    char *names = getenv("PM_STUB_DEVICE");
+    char *paths = getenv("PM_STUB_INPUT");
+    int i;
+
+    if (names == NULL) names = "nanoKONTROL2 nanoKONTROL2 _ CTR";
+
+    memset(devices, 0, sizeof(devices));
+    memset(stubs, 0, sizeof(stubs));
+    device_count = 0;
+
+    for (i = 0; i < MAX_STUB_DEVICES; i++) {
+        struct stub_device *stub = &stubs[device_count / 2];
+        if (list_item(names, i, stub->name, sizeof(stub->name)) == NULL) break;
+        if (paths == NULL || list_item(paths, i, stub->path, sizeof(stub->path)) == NULL) stub->path[0] = '\0';
+        if (stub->path[0] && access(stub->path, F_OK) != 0) continue;      /* not plugged in */
+        stub->number = i + 1;
+
+        devices[device_count].interf = "stub";
+        devices[device_count].name = stub->name;
+        devices[device_count].input = 1;
+        devices[device_count + 1].interf = "stub";
+        devices[device_count + 1].name = stub->name;
+        devices[device_count + 1].output = 1;
+        device_count += 2;
+    }
+}
+
+static struct stub_device *stream_device(PortMidiStream *stream, int **opened) {
+    int i;
+    for (i = 0; i < device_count / 2; i++) {
+        if (stream == &stubs[i].input_stream) {
+            *opened = &devices[i * 2].opened;
+            return &stubs[i];
+        }
+        if (stream == &stubs[i].output_stream) {
+            *opened = &devices[i * 2 + 1].opened;
+            return &stubs[i];
+        }
+    }
+    return NULL;
+}
+
+PmError Pm_Initialize(void) {
+    init_devices();
+    return pmNoError;
+}
+
+PmError Pm_Terminate(void) {
+    device_count = -1;
+    return pmNoError;
+}
+
+int Pm_CountDevices(void) {
+    if (device_count < 0) init_devices();
+    return device_count;
+}
+
+const PmDeviceInfo *Pm_GetDeviceInfo(PmDeviceID id) {
+    if (device_count < 0) init_devices();
+    return id >= 0 && id < device_count ? &devices[id] : NULL;
+}
+
+const char *Pm_GetErrorText(PmError errnum) {
+    return errnum == pmNoError ? "no error" : "stub error";
+}
+
+/*
+streams
+*/
+
+PmError Pm_OpenInput(PortMidiStream **stream, PmDeviceID inputDevice, void *inputDriverInfo,
+        int32_t bufferSize, PmTimeProcPtr time_proc, void *time_info) {
+    (void)inputDriverInfo, (void)bufferSize, (void)time_proc, (void)time_info;
+    if (inputDevice < 0 || inputDevice >= device_count || !devices[inputDevice].input) return pmInvalidDeviceId;
+
+    struct stub_device *stub = &stubs[inputDevice / 2];
+    if (stub->path[0]) {
+        int fd = open(stub->path, O_RDONLY | O_NONBLOCK);
+        if (fd >= 0) stub->input = fdopen(fd, "r");
+        if (stub->input == NULL) fprintf(stderr, "pm_stub: could not open %s\n", stub->path);
+        else fseek(stub->input, 0, SEEK_END);
+    }
+
+    devices[inputDevice].opened = 1;
+    *stream = &stub->input_stream;
+    return pmNoError;
+}
+
+PmError Pm_OpenOutput(PortMidiStream **stream, PmDeviceID outputDevice, void *outputDriverInfo,
+        int32_t bufferSize, PmTimeProcPtr time_proc, void *time_info, int32_t latency) {
+    (void)outputDriverInfo, (void)bufferSize, (void)time_proc, (void)time_info, (void)latency;
+    if (outputDevice < 0 || outputDevice >= device_count || !devices[outputDevice].output) return pmInvalidDeviceId;
+
+    if (output == NULL) {
+        char *path = getenv("PM_STUB_OUTPUT");
+        output = path ? fopen(path, "a") : stderr;
+        if (output == NULL) {
+            fprintf(stderr, "pm_stub: could not open %s\n", path);
+            output = stderr;
+        }
+    }
+    outputs_open++;
+
+    devices[outputDevice].opened = 1;
+    *stream = &stubs[outputDevice / 2].output_stream;
+    return pmNoError;
+}
+
+PmError Pm_Close(PortMidiStream *stream) {
+    int *opened;
+    struct stub_device *stub = stream_device(stream, &opened);
+    if (stub == NULL) return pmBadPtr;
+    *opened = 0;
+
+    if (stream == &stub->input_stream && stub->input) {
+        fclose(stub->input);
+        stub->input = NULL;
+    }
+    if (stream == &stub->output_stream && --outputs_open == 0 && output != stderr) {
+        fclose(output);
+        output = NULL;
+    }
+    return pmNoError;
+}
+
+int Pm_Read(PortMidiStream *stream, PmEvent *buffer, int32_t length) {
+    int count = 0;
+    char line[64];
+    unsigned int status, data1, data2;
+    int *opened;
+    struct stub_device *stub = stream_device(stream, &opened);
+
+    if (stub == NULL) return pmBadPtr;
+    if (stub->input == NULL) return 0;
+
+    while (count < length) {
+        if (fgets(line, sizeof(line), stub->input) == NULL) {
+            /* at the end for now, more may be appended later, unless unplugged */
+            clearerr(stub->input);
+            if (access(stub->path, F_OK) != 0) return pmHostError;
+            break;
+        }
+        if (sscanf(line, "%i %i %i", &status, &data1, &data2) != 3) continue;
+        buffer[count].message = Pm_Message(status, data1, data2);
+        buffer[count].timestamp = Pt_Time();
+        count++;
+    }
+    return count;
+}
+
+PmError Pm_Write(PortMidiStream *stream, PmEvent *buffer, int32_t length) {
+    int i;
+    int *opened;
+    struct stub_device *stub = stream_device(stream, &opened);
+    if (stub == NULL || output == NULL) return pmBadPtr;
+    for (i = 0; i < length; i++) {
+        PmMessage message = buffer[i].message;
+        fprintf(output, "%d %d out 0x%02x %d %d\n", Pt_Time(), stub->number,
+            Pm_MessageStatus(message), Pm_MessageData1(message), Pm_MessageData2(message));
+    }
+    fflush(output);
+    return pmNoError;
+}
+
+/*
+porttime
+*/
+
+static void *timer_loop(void *unused) {
+    (void)unused;
+    while (timer_running) {
+        if (timer_callback) timer_callback(Pt_Time(), timer_data);
+        usleep(timer_resolution * 1000);
+    }
+    return NULL;
+}
+
+PtError Pt_Start(int resolution, PtCallback *callback, void *userData) {
+    clock_gettime(CLOCK_MONOTONIC, &time_zero);
+    timer_callback = callback;
+    timer_data = userData;
+    timer_resolution = resolution;
+
+    /* without a callback only the time is kept, like porttime */
+    if (callback == NULL) return ptNoError;
+    timer_running = 1;
+    pthread_create(&timer_thread, NULL, timer_loop, NULL);
+    return ptNoError;
+}
+
+PtError Pt_Stop(void) {
+    if (timer_running) {
+        timer_running = 0;
+        pthread_join(timer_thread, NULL);
+    }
+    return ptNoError;
+}
+
+int Pt_Started(void) {
+    return timer_running;
+}
+
+PtTimestamp Pt_Time(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - time_zero.tv_sec) * 1000 + (now.tv_nsec - time_zero.tv_nsec) / 1000000;
+}